@@ -0,0 +1,418 @@
+/*
+ * Simple WHIP client
+ *
+ * Author:  Lorenzo Miniero <lorenzo@meetecho.com>
+ * License: GPLv3
+ *
+ * GStreamer "whipsink" element: a bin wrapping a webrtcbin instance, that
+ * uses libwhip (see whip.h) to publish whatever RTP streams are linked to
+ * it to a WHIP endpoint. Example:
+ *
+ *   gst-launch-1.0 videotestsrc ! vp8enc ! rtpvp8pay ! \
+ *     application/x-rtp,media=video,encoding-name=VP8,payload=96 ! \
+ *     whipsink location=http://localhost:7080/whip/endpoint/abc123
+ *
+ * libwhip needs a GMainLoop running on the context sessions are created
+ * in: since we can't expect applications to provide one, each element
+ * has its own context and thread, which live from NULL->READY until the
+ * session is torn down after READY->NULL.
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+/* Local includes */
+#include "whip.h"
+#include "debug.h"
+
+
+/* Element definition */
+typedef struct _GstWhipSink {
+	GstBin parent;
+	/* webrtcbin instance we wrap */
+	GstElement *webrtcbin;
+	/* WHIP session (protected by the mutex, as the stats may be read
+	 * from any thread while our thread is getting rid of it) */
+	whip_session *session;
+	/* Context, loop and thread the session lives in, and whether the
+	 * thread is done starting the session and, if so, if it succeeded */
+	GMainContext *context;
+	GMainLoop *loop;
+	GThread *thread;
+	GMutex mutex;
+	GCond cond;
+	gboolean ready, started;
+	/* Properties */
+	char *location, *auth_token, *ice_servers;
+	gboolean no_trickle, follow_link, force_turn;
+	/* STUN/TURN servers, parsed out of ice-servers */
+	char *stun_server, **turn_server;
+	/* Whether we're tearing down the session ourselves */
+	volatile gint stopping;
+	/* Counter for request pads */
+	guint pads;
+} GstWhipSink;
+typedef struct _GstWhipSinkClass {
+	GstBinClass parent_class;
+} GstWhipSinkClass;
+
+GType gst_whip_sink_get_type(void);
+#define GST_TYPE_WHIP_SINK (gst_whip_sink_get_type())
+#define GST_WHIP_SINK(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_WHIP_SINK, GstWhipSink))
+G_DEFINE_TYPE(GstWhipSink, gst_whip_sink, GST_TYPE_BIN);
+
+/* Properties */
+enum {
+	PROP_0,
+	PROP_LOCATION,
+	PROP_AUTH_TOKEN,
+	PROP_ICE_SERVERS,
+	PROP_NO_TRICKLE,
+	PROP_FOLLOW_LINK,
+	PROP_FORCE_TURN,
+	PROP_STATS
+};
+
+/* Pad templates: we accept RTP streams, which we pass to webrtcbin */
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE("sink_%u",
+	GST_PAD_SINK, GST_PAD_REQUEST, GST_STATIC_CAPS("application/x-rtp"));
+
+/* Helper method to parse the comma separated list of STUN/TURN servers */
+static void gst_whip_sink_parse_ice_servers(GstWhipSink *sink) {
+	g_clear_pointer(&sink->stun_server, g_free);
+	g_clear_pointer(&sink->turn_server, g_strfreev);
+	if(sink->ice_servers == NULL)
+		return;
+	GPtrArray *turn = g_ptr_array_new();
+	int i = 0;
+	gchar **servers = g_strsplit(sink->ice_servers, ",", -1);
+	while(servers[i] != NULL) {
+		char *server = g_strstrip(servers[i]);
+		if(strstr(server, "stun://") == server) {
+			if(sink->stun_server != NULL)
+				WHIP_LOG(LOG_WARN, "Ignoring multiple STUN servers...\n");
+			else
+				sink->stun_server = g_strdup(server);
+		} else if(strstr(server, "turn://") == server || strstr(server, "turns://") == server) {
+			g_ptr_array_add(turn, g_strdup(server));
+		} else if(*server != '\0') {
+			WHIP_LOG(LOG_WARN, "Invalid ICE server '%s', skipping...\n", server);
+		}
+		i++;
+	}
+	g_strfreev(servers);
+	if(turn->len > 0) {
+		g_ptr_array_add(turn, NULL);
+		sink->turn_server = (char **)g_ptr_array_free(turn, FALSE);
+	} else {
+		g_ptr_array_free(turn, TRUE);
+	}
+}
+
+/* Callback invoked when the WHIP session is torn down */
+static void gst_whip_sink_disconnected(whip_session *session, const char *reason, gpointer user_data) {
+	GstWhipSink *sink = GST_WHIP_SINK(user_data);
+	if(g_atomic_int_get(&sink->stopping)) {
+		/* We're done, our thread can get rid of the session */
+		g_main_loop_quit(sink->loop);
+		return;
+	}
+	/* Not something we asked for, let the application know */
+	GST_ELEMENT_ERROR(sink, RESOURCE, WRITE, ("WHIP session disconnected: %s", reason), (NULL));
+}
+
+/* Helper method to create the WHIP session and attach it to webrtcbin
+ * (called in our thread, as the session uses its default context) */
+static gboolean gst_whip_sink_start(GstWhipSink *sink) {
+	if(sink->location == NULL) {
+		GST_ELEMENT_ERROR(sink, RESOURCE, NOT_FOUND, ("No WHIP endpoint provided"), (NULL));
+		return FALSE;
+	}
+	gst_whip_sink_parse_ice_servers(sink);
+	whip_config *config = whip_config_new();
+	config->url = sink->location;
+	config->token = sink->auth_token;
+	config->no_trickle = sink->no_trickle;
+	config->follow_link = sink->follow_link;
+	config->stun_server = sink->stun_server;
+	config->turn_server = (const char **)sink->turn_server;
+	config->force_turn = sink->force_turn;
+	whip_session *session = whip_session_new(config);
+	whip_config_free(config);
+	if(session == NULL)
+		return FALSE;
+	whip_callbacks callbacks = { 0 };
+	callbacks.disconnected = gst_whip_sink_disconnected;
+	whip_session_set_callbacks(session, &callbacks, sink);
+	if(!whip_session_attach(session, sink->webrtcbin) || !whip_session_start(session)) {
+		whip_session_free(session);
+		GST_ELEMENT_ERROR(sink, RESOURCE, OPEN_WRITE, ("Error starting the WHIP session"), (NULL));
+		return FALSE;
+	}
+	g_mutex_lock(&sink->mutex);
+	sink->session = session;
+	g_mutex_unlock(&sink->mutex);
+	return TRUE;
+}
+
+/* Thread running the context the WHIP session lives in */
+static gpointer gst_whip_sink_thread(gpointer user_data) {
+	GstWhipSink *sink = GST_WHIP_SINK(user_data);
+	g_main_context_push_thread_default(sink->context);
+	gboolean started = gst_whip_sink_start(sink);
+	g_mutex_lock(&sink->mutex);
+	sink->ready = TRUE;
+	sink->started = started;
+	g_cond_signal(&sink->cond);
+	g_mutex_unlock(&sink->mutex);
+	/* Run until the session is torn down */
+	if(started)
+		g_main_loop_run(sink->loop);
+	g_mutex_lock(&sink->mutex);
+	whip_session *session = sink->session;
+	sink->session = NULL;
+	g_mutex_unlock(&sink->mutex);
+	if(session != NULL)
+		whip_session_free(session);
+	g_main_context_pop_thread_default(sink->context);
+	return NULL;
+}
+
+/* Helper method to wait for our thread to be done, and clean up after it */
+static void gst_whip_sink_join(GstWhipSink *sink) {
+	if(sink->thread == NULL)
+		return;
+	g_thread_join(sink->thread);
+	sink->thread = NULL;
+	g_main_loop_unref(sink->loop);
+	sink->loop = NULL;
+	g_main_context_unref(sink->context);
+	sink->context = NULL;
+}
+
+/* Helper method to start our thread, and wait for it to start the session */
+static gboolean gst_whip_sink_launch(GstWhipSink *sink) {
+	/* If a previous session is still being torn down, wait for it */
+	gst_whip_sink_join(sink);
+	g_atomic_int_set(&sink->stopping, 0);
+	sink->ready = FALSE;
+	sink->started = FALSE;
+	sink->context = g_main_context_new();
+	sink->loop = g_main_loop_new(sink->context, FALSE);
+	sink->thread = g_thread_new("whipsink", gst_whip_sink_thread, sink);
+	g_mutex_lock(&sink->mutex);
+	while(!sink->ready)
+		g_cond_wait(&sink->cond, &sink->mutex);
+	gboolean started = sink->started;
+	g_mutex_unlock(&sink->mutex);
+	if(!started)
+		gst_whip_sink_join(sink);
+	return started;
+}
+
+/* Main context callback to tear down the WHIP session without blocking */
+static gboolean gst_whip_sink_shutdown(gpointer user_data) {
+	GstWhipSink *sink = GST_WHIP_SINK(user_data);
+	if(whip_session_get_state(sink->session) == WHIP_SESSION_DISCONNECTED) {
+		/* Nothing to tear down, the session went away already */
+		g_main_loop_quit(sink->loop);
+	} else {
+		/* The DELETE is bounded by the teardown timeout, and the
+		 * disconnected callback will stop the loop when it's done */
+		whip_session_shutdown(sink->session, "Shutting down");
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* Helper method to tear down the WHIP session: this doesn't block, as
+ * the DELETE is sent by our thread, which exits when it's done */
+static void gst_whip_sink_stop(GstWhipSink *sink) {
+	if(sink->thread == NULL || !g_atomic_int_compare_and_exchange(&sink->stopping, 0, 1))
+		return;
+	g_main_context_invoke(sink->context, gst_whip_sink_shutdown, sink);
+}
+
+/* State changes: the session lives between READY and NULL */
+static GstStateChangeReturn gst_whip_sink_change_state(GstElement *element, GstStateChange transition) {
+	GstWhipSink *sink = GST_WHIP_SINK(element);
+	if(transition == GST_STATE_CHANGE_NULL_TO_READY) {
+		/* We need the signals connected before webrtcbin starts */
+		if(!gst_whip_sink_launch(sink))
+			return GST_STATE_CHANGE_FAILURE;
+	}
+	GstStateChangeReturn ret = GST_ELEMENT_CLASS(gst_whip_sink_parent_class)->change_state(element, transition);
+	if(transition == GST_STATE_CHANGE_READY_TO_NULL || ret == GST_STATE_CHANGE_FAILURE)
+		gst_whip_sink_stop(sink);
+	return ret;
+}
+
+/* Request pads are ghost pads for the webrtcbin sink pads */
+static GstPad *gst_whip_sink_request_new_pad(GstElement *element, GstPadTemplate *templ,
+		const gchar *name, const GstCaps *caps) {
+	GstWhipSink *sink = GST_WHIP_SINK(element);
+#if GST_CHECK_VERSION(1, 20, 0)
+	GstPad *target = gst_element_request_pad_simple(sink->webrtcbin, "sink_%u");
+#else
+	GstPad *target = gst_element_get_request_pad(sink->webrtcbin, "sink_%u");
+#endif
+	if(target == NULL)
+		return NULL;
+	char *pad_name = g_strdup_printf("sink_%u", sink->pads++);
+	GstPad *pad = gst_ghost_pad_new_from_template(pad_name, target, templ);
+	g_free(pad_name);
+	gst_object_unref(target);
+	gst_pad_set_active(pad, TRUE);
+	gst_element_add_pad(element, pad);
+	return pad;
+}
+
+static void gst_whip_sink_release_pad(GstElement *element, GstPad *pad) {
+	GstWhipSink *sink = GST_WHIP_SINK(element);
+	GstPad *target = gst_ghost_pad_get_target(GST_GHOST_PAD(pad));
+	gst_element_remove_pad(element, pad);
+	if(target != NULL) {
+		gst_element_release_request_pad(sink->webrtcbin, target);
+		gst_object_unref(target);
+	}
+}
+
+/* Properties management */
+static void gst_whip_sink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
+	GstWhipSink *sink = GST_WHIP_SINK(object);
+	switch(prop_id) {
+		case PROP_LOCATION:
+			g_free(sink->location);
+			sink->location = g_value_dup_string(value);
+			break;
+		case PROP_AUTH_TOKEN:
+			g_free(sink->auth_token);
+			sink->auth_token = g_value_dup_string(value);
+			break;
+		case PROP_ICE_SERVERS:
+			g_free(sink->ice_servers);
+			sink->ice_servers = g_value_dup_string(value);
+			break;
+		case PROP_NO_TRICKLE:
+			sink->no_trickle = g_value_get_boolean(value);
+			break;
+		case PROP_FOLLOW_LINK:
+			sink->follow_link = g_value_get_boolean(value);
+			break;
+		case PROP_FORCE_TURN:
+			sink->force_turn = g_value_get_boolean(value);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_whip_sink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
+	GstWhipSink *sink = GST_WHIP_SINK(object);
+	switch(prop_id) {
+		case PROP_LOCATION:
+			g_value_set_string(value, sink->location);
+			break;
+		case PROP_AUTH_TOKEN:
+			g_value_set_string(value, sink->auth_token);
+			break;
+		case PROP_ICE_SERVERS:
+			g_value_set_string(value, sink->ice_servers);
+			break;
+		case PROP_NO_TRICKLE:
+			g_value_set_boolean(value, sink->no_trickle);
+			break;
+		case PROP_FOLLOW_LINK:
+			g_value_set_boolean(value, sink->follow_link);
+			break;
+		case PROP_FORCE_TURN:
+			g_value_set_boolean(value, sink->force_turn);
+			break;
+		case PROP_STATS:
+			g_mutex_lock(&sink->mutex);
+			g_value_take_string(value, sink->session ? whip_session_get_stats(sink->session) : NULL);
+			g_mutex_unlock(&sink->mutex);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+			break;
+	}
+}
+
+static void gst_whip_sink_finalize(GObject *object) {
+	GstWhipSink *sink = GST_WHIP_SINK(object);
+	gst_whip_sink_stop(sink);
+	gst_whip_sink_join(sink);
+	g_mutex_clear(&sink->mutex);
+	g_cond_clear(&sink->cond);
+	g_free(sink->location);
+	g_free(sink->auth_token);
+	g_free(sink->ice_servers);
+	g_free(sink->stun_server);
+	g_strfreev(sink->turn_server);
+	G_OBJECT_CLASS(gst_whip_sink_parent_class)->finalize(object);
+}
+
+static void gst_whip_sink_init(GstWhipSink *sink) {
+	g_mutex_init(&sink->mutex);
+	g_cond_init(&sink->cond);
+	sink->webrtcbin = gst_element_factory_make("webrtcbin", "sendonly");
+	if(sink->webrtcbin == NULL) {
+		WHIP_LOG(LOG_FATAL, "Couldn't create webrtcbin\n");
+		return;
+	}
+	gst_bin_add(GST_BIN(sink), sink->webrtcbin);
+}
+
+static void gst_whip_sink_class_init(GstWhipSinkClass *klass) {
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+
+	gobject_class->set_property = gst_whip_sink_set_property;
+	gobject_class->get_property = gst_whip_sink_get_property;
+	gobject_class->finalize = gst_whip_sink_finalize;
+
+	g_object_class_install_property(gobject_class, PROP_LOCATION,
+		g_param_spec_string("location", "Location", "Address of the WHIP endpoint",
+			NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property(gobject_class, PROP_AUTH_TOKEN,
+		g_param_spec_string("auth-token", "Authentication token", "Authentication Bearer token to use",
+			NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property(gobject_class, PROP_ICE_SERVERS,
+		g_param_spec_string("ice-servers", "ICE servers",
+			"Comma separated list of STUN/TURN servers (stun://hostname:port, turn(s)://username:password@host:port?transport=[udp,tcp])",
+			NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property(gobject_class, PROP_NO_TRICKLE,
+		g_param_spec_boolean("no-trickle", "No trickle", "Don't trickle candidates, but put them in the SDP offer",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property(gobject_class, PROP_FOLLOW_LINK,
+		g_param_spec_boolean("follow-link", "Follow Link headers",
+			"Use the Link headers returned by the WHIP server to automatically configure STUN/TURN servers",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property(gobject_class, PROP_FORCE_TURN,
+		g_param_spec_boolean("force-turn", "Force TURN", "In case TURN servers are provided, force using a relay",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property(gobject_class, PROP_STATS,
+		g_param_spec_string("stats", "Stats", "Stats of the WHIP session, as a JSON string",
+			NULL, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	element_class->change_state = gst_whip_sink_change_state;
+	element_class->request_new_pad = gst_whip_sink_request_new_pad;
+	element_class->release_pad = gst_whip_sink_release_pad;
+	gst_element_class_add_static_pad_template(element_class, &sink_template);
+	gst_element_class_set_static_metadata(element_class, "WHIP sink", "Sink/Network/WebRTC",
+		"Publishes RTP streams to a WHIP endpoint", "Lorenzo Miniero <lorenzo@meetecho.com>");
+}
+
+/* Plugin registration */
+static gboolean plugin_init(GstPlugin *plugin) {
+	return gst_element_register(plugin, "whipsink", GST_RANK_NONE, GST_TYPE_WHIP_SINK);
+}
+
+GST_PLUGIN_DEFINE(GST_VERSION_MAJOR, GST_VERSION_MINOR, whip,
+	"WHIP publishing", plugin_init, "0.1", "GPL", "simple-whip-client",
+	"https://github.com/meetecho/simple-whip-client")
@@ -0,0 +1,5214 @@
+/*
+ * Simple WHIP client
+ *
+ * Author:  Lorenzo Miniero <lorenzo@meetecho.com>
+ * License: GPLv3
+ *
+ * Implementation of libwhip, the library implementing the WHIP logic
+ * (see whip.h for the public API): each session is a separate object,
+ * so that multiple sessions can be used within the same application.
+ *
+ * Based on webrtc-sendrecv.c, which is released under a BSD 2-Clause
+ * License and Copyright(c) 2017, Centricular:
+ * https://github.com/centricular/gstwebrtc-demos/blob/master/sendrecv/gst/webrtc-sendrecv.c
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* GLib */
+#include <glib/gstdio.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+#include <gst/rtp/rtp.h>
+#include <gst/video/video.h>
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+/* ICE agent (candidate filters) */
+#include <nice/agent.h>
+
+/* HTTP stack (WHIP API) */
+#include <libsoup/soup.h>
+
+/* JSON (stats) */
+#include <json-glib/json-glib.h>
+
+/* Local includes */
+#include "whip.h"
+#include "debug.h"
+
+
+/* Logging (shared by all sessions) */
+int whip_log_level = LOG_INFO;
+gboolean whip_log_timestamps = FALSE;
+gboolean whip_log_colors = TRUE;
+
+/* State management */
+enum whip_state {
+	WHIP_STATE_DISCONNECTED = 0,
+	WHIP_STATE_CONNECTING = 1,
+	WHIP_STATE_CONNECTION_ERROR,
+	WHIP_STATE_CONNECTED,
+	WHIP_STATE_PUBLISHING,
+	WHIP_STATE_OFFER_PREPARED,
+	WHIP_STATE_STARTED,
+	WHIP_STATE_API_ERROR,
+	WHIP_STATE_ERROR
+};
+
+/* WHIP session */
+struct whip_session {
+	/* Configuration (strings are owned by the application) */
+	whip_config config;
+	/* Main context the session lives in, and timers we attached to it */
+	GMainContext *context;
+	GList *sources;
+	/* Callbacks and related data */
+	whip_callbacks callbacks;
+	gpointer user_data;
+	/* Pipeline, bin with the media elements, and PeerConnection */
+	GstElement *pipeline, *pc;
+	GstBin *bin;
+	/* Whether we created the pipeline, or we're attached to a webrtcbin */
+	gboolean owned;
+	/* Public and internal state */
+	whip_session_state public_state;
+	enum whip_state state;
+	/* STUN/TURN servers, either from the configuration or from Link headers */
+	const char *stun_server, **turn_server;
+	char *auto_stun_server, **auto_turn_server;
+	/* HTTP debugging level */
+	SoupLoggerLogLevel soup_debug_level;
+	/* HTTP session shared by all the requests, if libsoup allows it */
+	SoupSession *http;
+	/* HTTP timing, per method */
+	GHashTable *http_timings;
+	GMutex http_mutex;
+	/* Timeout of synchronous HTTP requests, in seconds (0 means none) */
+	guint http_timeout;
+	/* Non-blocking shutdown: why we're shutting down, how many webrtcbin
+	 * sink pads we're still waiting an EOS on, the DELETE in flight (and
+	 * whether it was sent to a cached redirect, and how many redirects it
+	 * followed), and whether the deadline expired or we're done already */
+	volatile gint shutting_down, eos_pending, finished;
+	char *shutdown_reason;
+	SoupSession *teardown_http;
+	GCancellable *teardown_cancellable;
+	gboolean teardown_cached;
+	guint teardown_redirects;
+	gboolean deadline_expired;
+	/* Resource we created, and its latest ETag */
+	char *resource_url, *latest_etag;
+	/* SDP offer we're waiting to send, if not trickling */
+	GstWebRTCSessionDescription *offer;
+	/* Trickle ICE management */
+	char *ice_ufrag, *ice_pwd, *first_mid, *first_media;
+	GAsyncQueue *candidates;
+	gboolean gathering_done;
+	/* Whether we can send the offer (FALSE while in standby) */
+	gboolean publish;
+	GMutex mutex;
+	/* Whether we're stopping, or disconnected already */
+	volatile gint stopping, disconnected;
+	/* Video pipeline we built, if we picked the encoder ourselves */
+	char *auto_video_pipe;
+	/* CPU budget */
+	cpu_set_t encode_cpu_set, network_cpu_set;
+	int encode_cpu_count, network_cpu_count;
+	/* Latency probe stages, and the RTP extension ID we use for NTP-64 */
+	GPtrArray *latency_stages;
+	int latency_ext_id;
+	/* Profiled elements */
+	GPtrArray *profile_elements;
+	/* Video pacer, if any */
+	struct whip_pacer *pacer;
+	/* DTLS certificate and key (PEM) to use, if any */
+	char *dtls_pem;
+	/* Failover: tees feeding the PeerConnections, valves on the branch
+	 * feeding ours, and the session to the backup endpoint, if any */
+	GstElement *tees[2];
+	GPtrArray *valves;
+	whip_session *backup;
+	gboolean backup_active;
+	int next_backup;
+	/* If this is a backup session, the session it's a backup for: media
+	 * controllers (pacing, Opus, degradation) are only run by that one */
+	whip_session *primary;
+	volatile gint primary_failed;
+	GList *retired;
+	/* Temporary (307) redirects we got, valid for the whole session */
+	GHashTable *redirects;
+	/* Trickle: HTTP session (kept alive) for PATCH requests, batches waiting
+	 * to be sent, how many are in flight (one at most), and whether we're backing off */
+	SoupSession *trickle_http;
+	GQueue *trickle_queue;
+	guint trickle_inflight;
+	gboolean trickle_hold;
+	GCancellable *trickle_cancellable;
+	/* How many candidates of each type (host, srflx, prflx, relay) we signalled */
+	int candidate_counts[4];
+	/* Media socket (owned by the ICE agent): its inode, to look it up in
+	 * /proc/net/udp, its buffer sizes, and the drops we've reported */
+	int udp_fd, udp_sndbuf, udp_rcvbuf;
+	guint64 udp_inode, udp_drops;
+	/* DSCP we marked the media socket with, if any */
+	int udp_dscp;
+	/* Opus encoder we tune according to the audio profile, if any, and
+	 * the loss we estimated from RTCP (smoothed) and last configured */
+	GstElement *opusenc;
+	double opus_loss;
+	int opus_loss_pct;
+	/* Video degradation controller, if any */
+	struct whip_degradation *degradation;
+};
+
+/* Helper methods and callbacks */
+static char *whip_encoder_pipeline(whip_session *s, const char *source);
+static int whip_parse_cpu_list(const char *list, cpu_set_t *set);
+static int whip_encoder_max_threads(whip_session *s);
+static void whip_encoder_set_threads(const GValue *item, gpointer user_data);
+static GstBusSyncReply whip_bus_sync_handler(GstBus *bus, GstMessage *msg, gpointer user_data);
+static void whip_zero_copy_setup(whip_session *s);
+static void whip_dtls_warmup(void);
+static void whip_dtls_setup(whip_session *s);
+static void whip_options(whip_session *s);
+static void whip_options_links(whip_session *s, SoupMessage *msg);
+static gboolean whip_race(whip_session *s);
+static gboolean whip_ice_cache_load(whip_session *s);
+static void whip_ice_cache_store(whip_session *s);
+static void whip_dns_prefetch(const char *uri);
+static void whip_dns_prefetch_list(const char **uris);
+static gboolean whip_http_accept_certs(SoupMessage *msg, GTlsCertificate *certificate,
+	GTlsCertificateFlags tls_errors, gpointer user_data);
+static gboolean whip_initialize(whip_session *s);
+static void whip_configure_webrtcbin(whip_session *s);
+static void whip_ice_filters_setup(whip_session *s);
+static gboolean whip_candidate_allowed(whip_session *s, const char *candidate);
+static gboolean whip_udp_setup(gpointer user_data);
+static void whip_dscp_setup(whip_session *s);
+static void whip_opus_setup(whip_session *s);
+static void whip_opus_munge_sdp(whip_session *s, GstSDPMessage *sdp);
+static gboolean whip_opus_update(gpointer user_data);
+static gboolean whip_remote_loss(whip_session *s, guint clock_rate, double *loss);
+
+/* Degradation controller: when the encoder can't keep up, or the receiver
+ * reports too much loss, we scale down the resolution and/or framerate of
+ * the raw video (without renegotiating), and we go back up when things get
+ * better; levels only change when conditions persist, to avoid flapping */
+typedef struct whip_degradation {
+	/* Ladder of levels we can move through, and where we are */
+	const struct whip_degradation_level *ladder;
+	int levels, level;
+	/* Elements we use to figure out the source caps, and to constrain them */
+	GstElement *scaler, *capsfilter;
+	/* Frames in the encoder (PTS and when they got in), and the time the
+	 * encoder has spent on frames since the last check, in microseconds */
+	GQueue frames;
+	gint64 busy, since;
+	/* Latest encode usage and (smoothed) loss we computed */
+	double usage, loss;
+	/* How many consecutive checks were bad or good, and when we last switched */
+	int overuse, underuse;
+	gint64 last_switch;
+	/* The encoder probes are invoked from streaming threads */
+	GMutex mutex;
+} whip_degradation;
+static void whip_degradation_setup(whip_session *s);
+static gboolean whip_degradation_update(gpointer user_data);
+static void whip_degradation_free(whip_degradation *d);
+static void whip_negotiation_needed(GstElement *element, gpointer user_data);
+static void whip_offer_available(GstPromise *promise, gpointer user_data);
+static void whip_candidate(GstElement *webrtc G_GNUC_UNUSED,
+	guint mlineindex, char *candidate, gpointer user_data);
+static gboolean whip_send_candidates(gpointer user_data);
+static void whip_trickle_flush(whip_session *s);
+static void whip_connection_state(GstElement *webrtc, GParamSpec *pspec,
+	gpointer user_data);
+static void whip_ice_gathering_state(GstElement *webrtc, GParamSpec *pspec,
+	gpointer user_data);
+static void whip_ice_connection_state(GstElement *webrtc, GParamSpec *pspec,
+	gpointer user_data);
+static void whip_dtls_connection_state(GstElement *dtls, GParamSpec *pspec,
+	gpointer user_data);
+static void whip_maybe_connect(whip_session *s);
+static void whip_connect(whip_session *s, GstWebRTCSessionDescription *offer);
+static void whip_process_link_header(whip_session *s, char *link);
+static gboolean whip_parse_offer(whip_session *s, char *sdp_offer);
+static void whip_disconnect(whip_session *s, const char *reason);
+static void whip_teardown(whip_session *s, const char *reason);
+static void whip_teardown_finish(whip_session *s, const char *reason);
+static gboolean whip_shutdown_start(gpointer user_data);
+static gboolean whip_teardown_delete(gpointer user_data);
+static gboolean whip_teardown_send(whip_session *s, const char *url);
+static gboolean whip_failover(whip_session *s, const char *reason);
+static gboolean whip_failover_standby(gpointer user_data);
+static void whip_set_state(whip_session *s, whip_session_state state);
+static guint whip_add_timeout(whip_session *s, guint interval, GSourceFunc func);
+
+/* Helper method to iterate on all the elements in a bin */
+static void whip_foreach_element(GstBin *bin, GstIteratorForeachFunction func, gpointer user_data);
+static gboolean whip_element_has_klass(GstElement *element, const char *klass);
+
+/* Latency probe: we stamp the capture time in frames, and measure how long
+ * it takes for them to come out of encoders and to be handed to webrtcbin */
+typedef struct whip_latency_stage {
+	/* Name of the stage (e.g., encoder or webrtcbin pad name) */
+	char *name;
+	/* Samples collected since the last report */
+	guint64 count, total, min, max;
+	/* Latest capture timestamp we've seen, to only count frames once */
+	guint64 last_ts;
+	/* Stats are updated from streaming threads */
+	GMutex mutex;
+} whip_latency_stage;
+static GstCaps *ntp_caps = NULL;
+static void whip_latency_setup(whip_session *s);
+static void whip_latency_check_extmap(whip_session *s, GstSDPMessage *sdp);
+static gboolean whip_latency_report(gpointer user_data);
+static void whip_latency_stage_free(whip_latency_stage *stage);
+
+/* Profiling: we track how long each element takes to process buffers,
+ * how many buffers/bytes it produces, and how full queues are */
+typedef struct whip_profile_element {
+	/* Element we're profiling, and its name */
+	GstElement *element;
+	char *name;
+	/* Whether this is a queue (we track fill levels, not processing time) */
+	gboolean queue;
+	/* When the latest buffer entered the element (monotonic time) */
+	gint64 last_in;
+	/* Samples collected since the last report */
+	guint64 samples, proctime, buffers, bytes;
+	/* Snapshot of the average processing time, for sorting */
+	guint64 avg;
+	/* Stats are updated from streaming threads */
+	GMutex mutex;
+} whip_profile_element;
+static void whip_profile_setup(whip_session *s);
+static gboolean whip_profile_report(gpointer user_data);
+static void whip_profile_element_free(whip_profile_element *pe);
+
+/* Pacing: video packets go through a queue, and leave it at a multiple of
+ * the target bitrate (token bucket), so that keyframes are not sent as one
+ * burst; audio doesn't go through the pacer, so it always has priority */
+typedef struct whip_pacer {
+	/* Multiple of the input bitrate to pace at, and the bitrate the encoder
+	 * was configured with, if we know it (in bytes per second) */
+	double factor;
+	gint64 target;
+	/* Input bitrate we measured (smoothed), and the bytes we got in the
+	 * current measurement window, which started at in_start */
+	gint64 input, in_bytes, in_start;
+	/* Pacing rate, in bytes per second (0 means we don't know the bitrate
+	 * yet, so we don't pace), and how many bytes we can send in a burst */
+	gint64 rate, burst;
+	/* Bytes we can send right now, and when we last refilled them */
+	gint64 tokens, last;
+	/* When the packets waiting in the queue entered it */
+	GQueue arrivals;
+	/* Queue delay since the last report, in microseconds */
+	guint64 packets, total, max;
+	/* The pacer is used from streaming threads */
+	GMutex mutex;
+} whip_pacer;
+static void whip_pacer_setup(whip_session *s);
+static gboolean whip_pacer_report(gpointer user_data);
+static void whip_pacer_free(whip_pacer *pacer);
+
+/* Helper struct to handle libsoup HTTP sessions */
+typedef struct whip_http_session {
+	/* libsoup HTTP session */
+	SoupSession *http_conn;
+	/* libsoup HTTP message */
+	SoupMessage *msg;
+	/* Redirect url */
+	char *redirect_url;
+	/* Number of redirects happened so far */
+	guint redirects;
+	/* Whether the redirect url came from the redirect cache, and whether
+	 * we should ignore the cache (because a cached redirect failed) */
+	gboolean cached_redirect, skip_redirect_cache;
+} whip_http_session;
+/* Trickle: candidates are sent in batches via PATCH, one request at a
+ * time, so that the server gets them in order (requests in flight at the
+ * same time may be processed in any order, whatever the HTTP version),
+ * and failed batches are retried with an exponential backoff before giving
+ * up on them; candidates gathered in the meanwhile wait in the queue */
+#define WHIP_TRICKLE_RETRIES	5
+typedef struct whip_trickle_batch {
+	/* Session the batch belongs to */
+	whip_session *s;
+	/* SDP fragment to send, and ETag it was prepared for */
+	char *fragment, *etag;
+	/* Message currently in flight, if any, how many times we retried, and
+	 * how many redirects we followed (which don't count as retries) */
+	SoupMessage *msg;
+	guint attempts, redirects;
+} whip_trickle_batch;
+static void whip_trickle_batch_free(whip_trickle_batch *batch) {
+	g_free(batch->fragment);
+	g_free(batch->etag);
+	if(batch->msg != NULL)
+		g_object_unref(batch->msg);
+	g_free(batch);
+}
+static gboolean whip_trickle_retry(gpointer user_data);
+
+/* Helper methods to create HTTP sessions and messages, and send them */
+static SoupSession *whip_http_session_new(whip_session *s);
+static SoupMessage *whip_http_message(whip_session *s, const char *method,
+	const char *url, const char *payload, const char *content_type);
+static guint whip_http_send(whip_session *s, whip_http_session *session, char *method,
+	char *url, char *payload, char *content_type, GBytes **bytes);
+/* Redirect cache: permanent (301) redirects are shared by all sessions
+ * in the process, temporary (307) ones are only kept in the session */
+static GHashTable *whip_permanent_redirects = NULL;
+static GMutex whip_redirects_mutex;
+#define WHIP_REDIRECTS_MAX	10
+static char *whip_redirect_resolve(const char *requested, const char *location);
+static char *whip_redirect_lookup(whip_session *s, const char *url);
+static void whip_redirect_store(whip_session *s, const char *url, const char *target, gboolean permanent);
+static void whip_redirect_forget(whip_session *s, const char *url);
+
+/* HTTP timing: we collect the libsoup metrics of all requests, and keep
+ * per-method totals of each phase, and a histogram of the request times */
+#define WHIP_HTTP_BUCKETS	8
+static const guint whip_http_buckets[WHIP_HTTP_BUCKETS-1] = { 10, 25, 50, 100, 250, 500, 1000 };
+typedef struct whip_http_timing {
+	/* How many requests we sent */
+	guint requests;
+	/* Totals of each phase, in microseconds */
+	guint64 dns, connect, tls, wait, transfer, total;
+	/* Requests per total time (see whip_http_buckets, the last is for slower ones) */
+	guint histogram[WHIP_HTTP_BUCKETS];
+} whip_http_timing;
+static void whip_http_metrics(whip_session *s, SoupMessage *msg);
+
+
+/* Configuration management */
+whip_config *whip_config_new(void) {
+	whip_config *config = g_malloc0(sizeof(whip_config));
+	config->latency = -1;
+	config->http_debugging = "none";
+	config->profile_top = 5;
+	config->report_interval = 5;
+	config->encoder_profile = "low-latency";
+	config->video_bitrate = 1000;
+	config->keyframe_interval = 60;
+	config->ice_cache_ttl = 3600;
+	config->http_timing_log_level = 5;
+	config->teardown_timeout = 5000;
+	config->audio_ptime = 20;
+	return config;
+}
+
+void whip_config_free(whip_config *config) {
+	g_free(config);
+}
+
+/* Helper method to ensure GStreamer has the modules we need */
+gboolean whip_check_plugins(void) {
+	/* Note: since the pipeline is dynamic, there may be more requirements
+	 * (e.g., sources and encoders), but those will be checked when parsing
+	 * the pipeline, or when picking an encoder ourselves (--video-codec) */
+	const char *needed[] = {
+		"nice",
+		"webrtc",
+		"dtls",
+		"srtp",
+		"rtpmanager",
+		NULL
+	};
+	GstRegistry *registry = gst_registry_get();
+	if(registry == NULL) {
+		WHIP_LOG(LOG_FATAL, "No plugins registered in gstreamer\n");
+		return FALSE;
+	}
+	gboolean ret = TRUE;
+
+	int i = 0;
+	GstPlugin *plugin = NULL;
+	for(i = 0; i < g_strv_length((char **) needed); i++) {
+		plugin = gst_registry_find_plugin(registry, needed[i]);
+		if(plugin == NULL) {
+			WHIP_LOG(LOG_FATAL, "Required gstreamer plugin '%s' not found\n", needed[i]);
+			ret = FALSE;
+			continue;
+		}
+		gst_object_unref(plugin);
+	}
+	return ret;
+}
+
+/* Session management */
+whip_session *whip_session_new(const whip_config *config) {
+	if(config == NULL || config->url == NULL) {
+		WHIP_LOG(LOG_ERR, "Invalid configuration (missing WHIP endpoint)\n");
+		return NULL;
+	}
+	whip_session *s = g_malloc0(sizeof(whip_session));
+	s->config = *config;
+	s->context = g_main_context_ref_thread_default();
+	s->stun_server = config->stun_server;
+	s->turn_server = config->turn_server;
+	if(s->stun_server && strstr(s->stun_server, "stun://") != s->stun_server)
+		s->stun_server = NULL;
+	if(s->config.force_turn && !s->config.follow_link && !s->turn_server)
+		s->config.force_turn = FALSE;
+	/* Check if we need to enable libsoup logging */
+	s->soup_debug_level = SOUP_LOGGER_LOG_NONE;
+	if(config->http_debugging != NULL) {
+		if(!strcasecmp(config->http_debugging, "minimal"))
+			s->soup_debug_level = SOUP_LOGGER_LOG_MINIMAL;
+		else if(!strcasecmp(config->http_debugging, "headers"))
+			s->soup_debug_level = SOUP_LOGGER_LOG_HEADERS;
+		else if(!strcasecmp(config->http_debugging, "body"))
+			s->soup_debug_level = SOUP_LOGGER_LOG_BODY;
+	}
+	/* Validate the rest of the configuration */
+	if(s->config.report_interval < 1)
+		s->config.report_interval = 1;
+	if(s->config.latency_probe)
+		WHIP_LOG(LOG_INFO, "Latency probe:  enabled (reports every %ds)\n", s->config.report_interval);
+	if(s->config.profile_top < 1)
+		s->config.profile_top = 1;
+	if(s->config.profile) {
+		WHIP_LOG(LOG_INFO, "Profiling:      enabled (top %d, reports every %ds)\n",
+			s->config.profile_top, s->config.report_interval);
+	}
+	if(s->config.video_codec != NULL && s->config.video_pipe == NULL) {
+		WHIP_LOG(LOG_WARN, "Video codec provided but no video pipeline, ignoring...\n");
+		s->config.video_codec = NULL;
+	}
+	if(s->config.degradation != NULL && s->config.video_codec == NULL) {
+		WHIP_LOG(LOG_WARN, "Video degradation needs a video codec to pick an encoder for, ignoring...\n");
+		s->config.degradation = NULL;
+	}
+	if(s->config.video_codec != NULL) {
+		if(s->config.encoder_profile == NULL || (strcasecmp(s->config.encoder_profile, "low-latency") &&
+				strcasecmp(s->config.encoder_profile, "quality") && strcasecmp(s->config.encoder_profile, "low-cpu"))) {
+			WHIP_LOG(LOG_WARN, "Invalid encoder profile '%s', falling back to 'low-latency'\n",
+				s->config.encoder_profile ? s->config.encoder_profile : "(none)");
+			s->config.encoder_profile = "low-latency";
+		}
+		if(s->config.degradation != NULL && strcasecmp(s->config.degradation, "balanced") &&
+				strcasecmp(s->config.degradation, "maintain-framerate") &&
+				strcasecmp(s->config.degradation, "maintain-resolution")) {
+			WHIP_LOG(LOG_WARN, "Invalid degradation preference '%s', falling back to 'balanced'\n",
+				s->config.degradation);
+			s->config.degradation = "balanced";
+		}
+		if(s->config.video_bitrate < 1)
+			s->config.video_bitrate = 1000;
+		if(s->config.keyframe_interval < 1)
+			s->config.keyframe_interval = 60;
+		if(s->config.encoder_threads < 0)
+			s->config.encoder_threads = 0;
+		WHIP_LOG(LOG_INFO, "Video codec:    %s (profile: %s, %d kbps, keyframe every %d frames)\n",
+			s->config.video_codec, s->config.encoder_profile,
+			s->config.video_bitrate, s->config.keyframe_interval);
+	}
+	if(s->config.pacing_factor < 0) {
+		s->config.pacing_factor = 0;
+	} else if(s->config.pacing_factor > 0 && s->config.pacing_factor < 1) {
+		/* Pacing below the input bitrate would just fill the queue */
+		WHIP_LOG(LOG_WARN, "Invalid pacing factor %.2f (can't be lower than 1), using 1\n", s->config.pacing_factor);
+		s->config.pacing_factor = 1;
+	}
+	if(s->config.audio_profile != NULL) {
+		if(strcasecmp(s->config.audio_profile, "voice") && strcasecmp(s->config.audio_profile, "music")) {
+			WHIP_LOG(LOG_WARN, "Invalid audio profile '%s', ignoring...\n", s->config.audio_profile);
+			s->config.audio_profile = NULL;
+		} else {
+			if(s->config.audio_ptime != 10 && s->config.audio_ptime != 20 &&
+					s->config.audio_ptime != 40 && s->config.audio_ptime != 60) {
+				WHIP_LOG(LOG_WARN, "Invalid audio ptime %d, falling back to 20ms\n", s->config.audio_ptime);
+				s->config.audio_ptime = 20;
+			}
+			WHIP_LOG(LOG_INFO, "Audio profile:  %s (%dms frames)\n", s->config.audio_profile, s->config.audio_ptime);
+		}
+	}
+	if(s->config.encode_cpus != NULL) {
+		s->encode_cpu_count = whip_parse_cpu_list(s->config.encode_cpus, &s->encode_cpu_set);
+		if(s->encode_cpu_count == 0) {
+			WHIP_LOG(LOG_WARN, "Invalid list of encode CPUs '%s', ignoring...\n", s->config.encode_cpus);
+		} else {
+			WHIP_LOG(LOG_INFO, "Encode CPUs:    %s (%d cores)\n",
+				s->config.encode_cpus, s->encode_cpu_count);
+		}
+	}
+	if(s->config.network_cpus != NULL) {
+		s->network_cpu_count = whip_parse_cpu_list(s->config.network_cpus, &s->network_cpu_set);
+		if(s->network_cpu_count == 0) {
+			WHIP_LOG(LOG_WARN, "Invalid list of network CPUs '%s', ignoring...\n", s->config.network_cpus);
+		} else {
+			WHIP_LOG(LOG_INFO, "Network CPUs:   %s (%d cores)\n",
+				s->config.network_cpus, s->network_cpu_count);
+		}
+	}
+	if(s->config.dtls_pem != NULL) {
+		if(g_file_test(s->config.dtls_pem, G_FILE_TEST_EXISTS)) {
+			GError *error = NULL;
+			/* If the file can't be used, we generate a new certificate, but
+			 * never save it there, as we'd overwrite the user's file */
+			if(!g_file_get_contents(s->config.dtls_pem, &s->dtls_pem, NULL, &error)) {
+				WHIP_LOG(LOG_WARN, "Couldn't read DTLS certificate (%s), generating a new one (won't be saved)\n", error->message);
+				g_error_free(error);
+			} else if(strstr(s->dtls_pem, "BEGIN CERTIFICATE") == NULL || strstr(s->dtls_pem, "PRIVATE KEY") == NULL) {
+				WHIP_LOG(LOG_WARN, "Invalid DTLS certificate (should contain both certificate and key), generating a new one (won't be saved)\n");
+				g_clear_pointer(&s->dtls_pem, g_free);
+			} else {
+				WHIP_LOG(LOG_INFO, "DTLS cert:      %s\n", s->config.dtls_pem);
+			}
+		} else {
+			WHIP_LOG(LOG_INFO, "DTLS cert:      %s (will be generated)\n", s->config.dtls_pem);
+		}
+	}
+	/* Start generating the DTLS certificate in the background, if needed */
+	whip_dtls_warmup();
+	s->publish = !s->config.standby;
+	if(s->config.standby)
+		WHIP_LOG(LOG_INFO, "Standby:        yes (publish on trigger)\n");
+	g_mutex_init(&s->mutex);
+	/* Create a queue for gathered candidates */
+	s->candidates = g_async_queue_new_full((GDestroyNotify)g_free);
+	s->redirects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	s->http_timings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_mutex_init(&s->http_mutex);
+#if SOUP_CHECK_VERSION(3, 2, 0)
+	/* Sessions are thread safe, so we can share one for all requests: this
+	 * way connections are reused and, if the server supports HTTP/2 (which
+	 * libsoup negotiates via ALPN), all requests are multiplexed on one */
+	s->http = whip_http_session_new(s);
+#endif
+	s->trickle_queue = g_queue_new();
+	s->trickle_cancellable = g_cancellable_new();
+	return s;
+}
+
+gboolean whip_session_attach(whip_session *s, GstElement *webrtcbin) {
+	if(s == NULL || webrtcbin == NULL || s->pc != NULL) {
+		WHIP_LOG(LOG_ERR, "Invalid arguments, or session already started...\n");
+		return FALSE;
+	}
+	GstObject *parent = gst_object_get_parent(GST_OBJECT(webrtcbin));
+	if(parent == NULL || !GST_IS_BIN(parent)) {
+		WHIP_LOG(LOG_ERR, "The webrtcbin element must be in a bin\n");
+		if(parent != NULL)
+			gst_object_unref(parent);
+		return FALSE;
+	}
+	s->pc = gst_object_ref(webrtcbin);
+	s->bin = GST_BIN(parent);
+	s->owned = FALSE;
+	/* Make sure we bundle on a single transport, as we trickle on the first m-line */
+	g_object_set(s->pc, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, NULL);
+	return TRUE;
+}
+
+void whip_session_set_callbacks(whip_session *s, const whip_callbacks *callbacks, gpointer user_data) {
+	if(s == NULL)
+		return;
+	if(callbacks != NULL)
+		s->callbacks = *callbacks;
+	else
+		memset(&s->callbacks, 0, sizeof(s->callbacks));
+	s->user_data = user_data;
+}
+
+gboolean whip_session_start(whip_session *s) {
+	if(s == NULL)
+		return FALSE;
+	if(s->pc == NULL && s->config.audio_pipe == NULL && s->config.video_pipe == NULL) {
+		WHIP_LOG(LOG_ERR, "No pipeline to publish, and not attached to a webrtcbin\n");
+		return FALSE;
+	}
+	/* If we need to pick a video encoder ourselves, do it now */
+	if(s->pc == NULL && s->config.video_codec != NULL && s->auto_video_pipe == NULL) {
+		s->auto_video_pipe = whip_encoder_pipeline(s, s->config.video_pipe);
+		if(s->auto_video_pipe == NULL)
+			return FALSE;
+		WHIP_LOG(LOG_INFO, "Video pipeline: %s\n\n", s->auto_video_pipe);
+	}
+	/* Resolve all the hosts we know about in parallel, in advance (this
+	 * does nothing, unless the application enabled the DNS cache) */
+	whip_dns_prefetch(s->config.url);
+	whip_dns_prefetch_list(s->config.race_urls);
+	whip_dns_prefetch_list(s->config.backup_urls);
+	whip_dns_prefetch(s->stun_server);
+	whip_dns_prefetch_list(s->turn_server);
+	/* If we have alternative endpoints, pick the fastest one */
+	gboolean options_done = FALSE;
+	if(s->config.race_urls != NULL && s->config.race_urls[0] != NULL)
+		options_done = whip_race(s);
+	/* If we need to autoconfigure STUN/TURN, send an OPTIONS (unless
+	 * we got the Link headers from the race already, or cached them) */
+	if(s->config.follow_link && !options_done && s->config.ice_cache != NULL)
+		options_done = whip_ice_cache_load(s);
+	if(s->config.follow_link && !options_done) {
+		whip_options(s);
+		if(s->config.ice_cache != NULL)
+			whip_ice_cache_store(s);
+	}
+	whip_dns_prefetch(s->auto_stun_server);
+	whip_dns_prefetch_list((const char **)s->auto_turn_server);
+	/* Initialize the stack (and then connect to the WHIP endpoint) */
+	return whip_initialize(s);
+}
+
+gboolean whip_session_publish(whip_session *s) {
+	if(s == NULL || s->publish)
+		return FALSE;
+	WHIP_PREFIX(LOG_INFO, "Publishing\n");
+	s->publish = TRUE;
+	whip_maybe_connect(s);
+	return TRUE;
+}
+
+void whip_session_stop(whip_session *s, const char *reason) {
+	if(s == NULL)
+		return;
+	g_atomic_int_set(&s->stopping, 1);
+	whip_disconnect(s, reason ? reason : "Shutting down");
+}
+
+void whip_session_shutdown(whip_session *s, const char *reason) {
+	if(s == NULL || !g_atomic_int_compare_and_exchange(&s->shutting_down, 0, 1))
+		return;
+	s->shutdown_reason = g_strdup(reason ? reason : "Shutting down");
+	g_main_context_invoke(s->context, whip_shutdown_start, s);
+}
+
+whip_session_state whip_session_get_state(whip_session *s) {
+	return s ? s->public_state : WHIP_SESSION_DISCONNECTED;
+}
+
+GstElement *whip_session_get_pipeline(whip_session *s) {
+	return s ? s->pipeline : NULL;
+}
+
+char *whip_session_get_stats(whip_session *s) {
+	if(s == NULL)
+		return NULL;
+	const char *states[] = { "idle", "connecting", "connected", "disconnected", "ready" };
+	JsonBuilder *builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "state");
+	json_builder_add_string_value(builder, states[s->public_state]);
+	json_builder_set_member_name(builder, "endpoint");
+	json_builder_add_string_value(builder, s->backup_active ? s->backup->config.url : s->config.url);
+	if(s->resource_url != NULL) {
+		json_builder_set_member_name(builder, "resource");
+		json_builder_add_string_value(builder, s->resource_url);
+	}
+	if(s->pacer != NULL) {
+		/* Pacing queue delay since the latest report, in milliseconds */
+		g_mutex_lock(&s->pacer->mutex);
+		json_builder_set_member_name(builder, "pacing");
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "input-kbps");
+		json_builder_add_int_value(builder, s->pacer->input * 8 / 1000);
+		json_builder_set_member_name(builder, "rate-kbps");
+		json_builder_add_int_value(builder, s->pacer->rate * 8 / 1000);
+		json_builder_set_member_name(builder, "packets");
+		json_builder_add_int_value(builder, s->pacer->packets);
+		if(s->pacer->packets > 0) {
+			json_builder_set_member_name(builder, "avg");
+			json_builder_add_double_value(builder, (double)s->pacer->total / s->pacer->packets / 1000);
+			json_builder_set_member_name(builder, "max");
+			json_builder_add_double_value(builder, (double)s->pacer->max / 1000);
+		}
+		json_builder_end_object(builder);
+		g_mutex_unlock(&s->pacer->mutex);
+	}
+	if(s->degradation != NULL) {
+		/* Video degradation */
+		g_mutex_lock(&s->degradation->mutex);
+		json_builder_set_member_name(builder, "degradation");
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "level");
+		json_builder_add_int_value(builder, s->degradation->level);
+		json_builder_set_member_name(builder, "encode-usage");
+		json_builder_add_double_value(builder, s->degradation->usage);
+		json_builder_set_member_name(builder, "loss");
+		json_builder_add_double_value(builder, s->degradation->loss);
+		json_builder_end_object(builder);
+		g_mutex_unlock(&s->degradation->mutex);
+	}
+	if(s->udp_fd > 0) {
+		/* Media socket */
+		json_builder_set_member_name(builder, "udp");
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "sndbuf");
+		json_builder_add_int_value(builder, s->udp_sndbuf);
+		json_builder_set_member_name(builder, "rcvbuf");
+		json_builder_add_int_value(builder, s->udp_rcvbuf);
+		json_builder_set_member_name(builder, "drops");
+		json_builder_add_int_value(builder, s->udp_drops);
+		if(s->udp_dscp > 0) {
+			json_builder_set_member_name(builder, "dscp");
+			json_builder_add_int_value(builder, s->udp_dscp);
+		}
+		json_builder_end_object(builder);
+	}
+	/* Timing of the HTTP requests we sent, in milliseconds */
+	g_mutex_lock(&s->http_mutex);
+	if(g_hash_table_size(s->http_timings) > 0) {
+		json_builder_set_member_name(builder, "http");
+		json_builder_begin_object(builder);
+		GHashTableIter iter;
+		gpointer key = NULL, value = NULL;
+		g_hash_table_iter_init(&iter, s->http_timings);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			whip_http_timing *timing = (whip_http_timing *)value;
+			json_builder_set_member_name(builder, (const char *)key);
+			json_builder_begin_object(builder);
+			json_builder_set_member_name(builder, "requests");
+			json_builder_add_int_value(builder, timing->requests);
+			const char *phases[] = { "dns", "connect", "tls", "wait", "transfer", "total" };
+			guint64 totals[] = { timing->dns, timing->connect, timing->tls, timing->wait, timing->transfer, timing->total };
+			int p = 0;
+			for(p = 0; p < 6; p++) {
+				json_builder_set_member_name(builder, phases[p]);
+				json_builder_add_double_value(builder, (double)totals[p] / timing->requests / 1000);
+			}
+			json_builder_set_member_name(builder, "histogram");
+			json_builder_begin_object(builder);
+			int b = 0;
+			for(b = 0; b < WHIP_HTTP_BUCKETS; b++) {
+				char bucket[16];
+				if(b < WHIP_HTTP_BUCKETS-1)
+					g_snprintf(bucket, sizeof(bucket), "<%u", whip_http_buckets[b]);
+				else
+					g_snprintf(bucket, sizeof(bucket), ">=%u", whip_http_buckets[b-1]);
+				json_builder_set_member_name(builder, bucket);
+				json_builder_add_int_value(builder, timing->histogram[b]);
+			}
+			json_builder_end_object(builder);
+			json_builder_end_object(builder);
+		}
+		json_builder_end_object(builder);
+	}
+	g_mutex_unlock(&s->http_mutex);
+	guint i = 0;
+	if(s->latency_stages != NULL) {
+		/* Latency since the latest report, in milliseconds */
+		json_builder_set_member_name(builder, "latency");
+		json_builder_begin_array(builder);
+		for(i = 0; i < s->latency_stages->len; i++) {
+			whip_latency_stage *stage = g_ptr_array_index(s->latency_stages, i);
+			g_mutex_lock(&stage->mutex);
+			json_builder_begin_object(builder);
+			json_builder_set_member_name(builder, "stage");
+			json_builder_add_string_value(builder, stage->name);
+			json_builder_set_member_name(builder, "frames");
+			json_builder_add_int_value(builder, stage->count);
+			if(stage->count > 0) {
+				json_builder_set_member_name(builder, "min");
+				json_builder_add_double_value(builder, (double)stage->min / GST_MSECOND);
+				json_builder_set_member_name(builder, "avg");
+				json_builder_add_double_value(builder, (double)stage->total / stage->count / GST_MSECOND);
+				json_builder_set_member_name(builder, "max");
+				json_builder_add_double_value(builder, (double)stage->max / GST_MSECOND);
+			}
+			json_builder_end_object(builder);
+			g_mutex_unlock(&stage->mutex);
+		}
+		json_builder_end_array(builder);
+	}
+	if(s->profile_elements != NULL) {
+		/* Profiling since the latest report */
+		json_builder_set_member_name(builder, "profile");
+		json_builder_begin_array(builder);
+		for(i = 0; i < s->profile_elements->len; i++) {
+			whip_profile_element *pe = g_ptr_array_index(s->profile_elements, i);
+			g_mutex_lock(&pe->mutex);
+			json_builder_begin_object(builder);
+			json_builder_set_member_name(builder, "element");
+			json_builder_add_string_value(builder, pe->name);
+			if(!pe->queue) {
+				json_builder_set_member_name(builder, "proctime-ms");
+				json_builder_add_double_value(builder, pe->samples ? (double)pe->proctime / pe->samples / 1000 : 0);
+			}
+			json_builder_set_member_name(builder, "buffers");
+			json_builder_add_int_value(builder, pe->buffers);
+			json_builder_set_member_name(builder, "bytes");
+			json_builder_add_int_value(builder, pe->bytes);
+			json_builder_end_object(builder);
+			g_mutex_unlock(&pe->mutex);
+		}
+		json_builder_end_array(builder);
+	}
+	json_builder_end_object(builder);
+	JsonNode *root = json_builder_get_root(builder);
+	char *stats = json_to_string(root, FALSE);
+	json_node_unref(root);
+	g_object_unref(builder);
+	return stats;
+}
+
+void whip_session_free(whip_session *s) {
+	if(s == NULL)
+		return;
+	/* Get rid of the timers we attached to the loop */
+	GList *temp = s->sources;
+	while(temp != NULL) {
+		g_source_destroy((GSource *)temp->data);
+		g_source_unref((GSource *)temp->data);
+		temp = temp->next;
+	}
+	g_list_free(s->sources);
+	/* Abort the DELETE in flight, if any */
+	if(s->teardown_cancellable != NULL) {
+		g_cancellable_cancel(s->teardown_cancellable);
+		g_object_unref(s->teardown_cancellable);
+	}
+	if(s->teardown_http != NULL)
+		g_object_unref(s->teardown_http);
+	g_free(s->shutdown_reason);
+	/* Abort the trickle requests in flight, and get rid of queued ones */
+	if(s->trickle_cancellable != NULL) {
+		g_cancellable_cancel(s->trickle_cancellable);
+		g_object_unref(s->trickle_cancellable);
+	}
+	if(s->trickle_queue != NULL)
+		g_queue_free_full(s->trickle_queue, (GDestroyNotify)whip_trickle_batch_free);
+	if(s->trickle_http != NULL)
+		g_object_unref(s->trickle_http);
+	if(s->http != NULL)
+		g_object_unref(s->http);
+	if(s->http_timings != NULL)
+		g_hash_table_destroy(s->http_timings);
+	g_mutex_clear(&s->http_mutex);
+	/* Get rid of the sessions to backup endpoints, if any */
+	if(s->backup != NULL)
+		whip_session_free(s->backup);
+	g_list_free_full(s->retired, (GDestroyNotify)whip_session_free);
+	if(s->valves != NULL)
+		g_ptr_array_free(s->valves, TRUE);
+	if(s->tees[0] != NULL)
+		gst_object_unref(s->tees[0]);
+	if(s->tees[1] != NULL)
+		gst_object_unref(s->tees[1]);
+	if(s->pc != NULL) {
+		GstElement *dtls = gst_bin_get_by_name(GST_BIN(s->pc), "dtlsdec0");
+		if(dtls != NULL) {
+			g_signal_handlers_disconnect_by_data(dtls, s);
+			gst_object_unref(dtls);
+		}
+		g_signal_handlers_disconnect_by_data(s->pc, s);
+		gst_object_unref(s->pc);
+	}
+	if(s->pipeline != NULL) {
+		gst_element_set_state(GST_ELEMENT(s->pipeline), GST_STATE_NULL);
+		WHIP_PREFIX(LOG_INFO, "GStreamer pipeline stopped\n");
+		gst_object_unref(s->pipeline);
+	}
+	if(s->bin != NULL && !s->owned)
+		gst_object_unref(s->bin);
+	if(s->offer != NULL)
+		gst_webrtc_session_description_free(s->offer);
+	g_free(s->resource_url);
+	g_free(s->latest_etag);
+	g_free(s->ice_ufrag);
+	g_free(s->ice_pwd);
+	g_free(s->first_mid);
+	g_free(s->first_media);
+	if(s->candidates != NULL)
+		g_async_queue_unref(s->candidates);
+	g_free(s->auto_stun_server);
+	if(s->auto_turn_server != NULL) {
+		int count = 0;
+		while(s->auto_turn_server[count] != NULL) {
+			g_free(s->auto_turn_server[count]);
+			count++;
+		}
+	}
+	g_free(s->auto_turn_server);
+	g_free(s->auto_video_pipe);
+	g_free(s->dtls_pem);
+	if(s->latency_stages != NULL)
+		g_ptr_array_free(s->latency_stages, TRUE);
+	if(s->profile_elements != NULL)
+		g_ptr_array_free(s->profile_elements, TRUE);
+	whip_pacer_free(s->pacer);
+	if(s->opusenc != NULL)
+		gst_object_unref(s->opusenc);
+	whip_degradation_free(s->degradation);
+	if(s->redirects != NULL) {
+		g_mutex_lock(&whip_redirects_mutex);
+		g_hash_table_destroy(s->redirects);
+		g_mutex_unlock(&whip_redirects_mutex);
+	}
+	g_mutex_clear(&s->mutex);
+	g_main_context_unref(s->context);
+	g_free(s);
+}
+
+/* Helper method to update the public state, and notify the application */
+static void whip_set_state(whip_session *s, whip_session_state state) {
+	if(s->public_state == state)
+		return;
+	s->public_state = state;
+	if(s->callbacks.state_changed != NULL)
+		s->callbacks.state_changed(s, state, s->user_data);
+}
+
+/* Helper method to add a timer to the session context */
+static guint whip_add_timeout(whip_session *s, guint interval, GSourceFunc func) {
+	GSource *timer = g_timeout_source_new(interval);
+	g_source_set_callback(timer, func, s, NULL);
+	guint id = g_source_attach(timer, s->context);
+	s->sources = g_list_append(s->sources, timer);
+	return id;
+}
+
+
+/* Encoder profiles: for each codec we have a list of encoders we know
+ * how to tune, each with properties for the different profiles we
+ * support (low-latency, quality, low-cpu). Properties can contain some
+ * placeholders that are replaced at runtime: {kbps} and {bps} for the
+ * target bitrate, {keyint} for the keyframe interval, and {threads} */
+enum whip_encoder_target {
+	WHIP_ENCODER_LOW_LATENCY = 0,
+	WHIP_ENCODER_QUALITY,
+	WHIP_ENCODER_LOW_CPU
+};
+typedef struct whip_encoder {
+	/* Codec (vp8, vp9, h264, av1) */
+	const char *codec;
+	/* Encoder element */
+	const char *element;
+	/* Rank for each profile (higher is better, 0 means don't use) */
+	int rank[3];
+	/* Properties to set for each profile */
+	const char *props[3];
+	/* Caps to enforce after the encoder, if any */
+	const char *caps;
+	/* RTP payloader and its properties */
+	const char *payloader, *payloader_props;
+	/* Encoding name to use in the RTP caps */
+	const char *encoding;
+} whip_encoder;
+static whip_encoder whip_encoders[] = {
+	{ "vp8", "vp8enc", { 10, 10, 10 },
+		{ "deadline=1 cpu-used=8 end-usage=cbr target-bitrate={bps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0 error-resilient=partitions buffer-initial-size=500 buffer-optimal-size=600 buffer-size=1000",
+		  "deadline=1 cpu-used=4 end-usage=cbr target-bitrate={bps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0 error-resilient=partitions",
+		  "deadline=1 cpu-used=16 end-usage=cbr target-bitrate={bps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0 error-resilient=partitions" },
+		NULL, "rtpvp8pay", "", "VP8" },
+	{ "vp9", "vp9enc", { 10, 10, 10 },
+		{ "deadline=1 cpu-used=8 end-usage=cbr target-bitrate={bps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0 error-resilient=default",
+		  "deadline=1 cpu-used=4 end-usage=cbr target-bitrate={bps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0 error-resilient=default",
+		  "deadline=1 cpu-used=9 end-usage=cbr target-bitrate={bps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0 error-resilient=default" },
+		NULL, "rtpvp9pay", "", "VP9" },
+	{ "h264", "x264enc", { 20, 20, 10 },
+		{ "tune=zerolatency speed-preset=ultrafast pass=cbr bitrate={kbps} key-int-max={keyint} threads={threads} bframes=0",
+		  "tune=zerolatency speed-preset=faster pass=cbr bitrate={kbps} key-int-max={keyint} threads={threads} bframes=0",
+		  "tune=zerolatency speed-preset=ultrafast pass=cbr bitrate={kbps} key-int-max={keyint} threads={threads} bframes=0" },
+		"video/x-h264,profile=constrained-baseline", "rtph264pay", "config-interval=-1 aggregate-mode=zero-latency", "H264" },
+	{ "h264", "openh264enc", { 10, 10, 20 },
+		{ "complexity=low usage-type=camera rate-control=bitrate bitrate={bps} gop-size={keyint} multi-thread={threads}",
+		  "complexity=high usage-type=camera rate-control=bitrate bitrate={bps} gop-size={keyint} multi-thread={threads}",
+		  "complexity=low usage-type=camera rate-control=bitrate bitrate={bps} gop-size={keyint} multi-thread={threads}" },
+		"video/x-h264,profile=constrained-baseline", "rtph264pay", "config-interval=-1 aggregate-mode=zero-latency", "H264" },
+	{ "av1", "svtav1enc", { 30, 20, 30 },
+		{ "preset=12 target-bitrate={kbps} intra-period-length={keyint}",
+		  "preset=8 target-bitrate={kbps} intra-period-length={keyint}",
+		  "preset=13 target-bitrate={kbps} intra-period-length={keyint}" },
+		NULL, "rtpav1pay", "", "AV1" },
+	{ "av1", "rav1enc", { 20, 30, 10 },
+		{ "speed-preset=10 low-latency=true bitrate={bps} max-key-frame-interval={keyint} threads={threads}",
+		  "speed-preset=6 low-latency=true bitrate={bps} max-key-frame-interval={keyint} threads={threads}",
+		  "speed-preset=10 low-latency=true bitrate={bps} max-key-frame-interval={keyint} threads={threads}" },
+		NULL, "rtpav1pay", "", "AV1" },
+	{ "av1", "av1enc", { 10, 10, 0 },
+		{ "usage-profile=realtime cpu-used=10 end-usage=cbr target-bitrate={kbps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0",
+		  "usage-profile=realtime cpu-used=7 end-usage=cbr target-bitrate={kbps} keyframe-max-dist={keyint} threads={threads} lag-in-frames=0",
+		  NULL },
+		NULL, "rtpav1pay", "", "AV1" },
+	{ NULL, NULL, { 0, 0, 0 }, { NULL, NULL, NULL }, NULL, NULL, NULL, NULL }
+};
+
+/* Helper method to check if an element is available */
+static gboolean whip_element_available(const char *name) {
+	GstElementFactory *factory = gst_element_factory_find(name);
+	if(factory == NULL)
+		return FALSE;
+	gst_object_unref(factory);
+	return TRUE;
+}
+
+/* Helper method to replace the placeholders in encoder properties */
+static char *whip_encoder_expand(whip_session *s, const char *props, int threads) {
+	GString *expanded = g_string_new(NULL);
+	const char *p = props;
+	while(*p != '\0') {
+		if(*p == '{') {
+			if(strstr(p, "{kbps}") == p) {
+				g_string_append_printf(expanded, "%d", s->config.video_bitrate);
+				p += strlen("{kbps}");
+				continue;
+			} else if(strstr(p, "{bps}") == p) {
+				g_string_append_printf(expanded, "%d", s->config.video_bitrate * 1000);
+				p += strlen("{bps}");
+				continue;
+			} else if(strstr(p, "{keyint}") == p) {
+				g_string_append_printf(expanded, "%d", s->config.keyframe_interval);
+				p += strlen("{keyint}");
+				continue;
+			} else if(strstr(p, "{threads}") == p) {
+				g_string_append_printf(expanded, "%d", threads);
+				p += strlen("{threads}");
+				continue;
+			}
+		}
+		g_string_append_c(expanded, *p);
+		p++;
+	}
+	return g_string_free(expanded, FALSE);
+}
+
+/* Helper method to pick the best encoder for the codec and profile, and
+ * return the video pipeline that encodes the provided raw source with it */
+static char *whip_encoder_pipeline(whip_session *s, const char *source) {
+	enum whip_encoder_target target = WHIP_ENCODER_LOW_LATENCY;
+	if(!strcasecmp(s->config.encoder_profile, "quality"))
+		target = WHIP_ENCODER_QUALITY;
+	else if(!strcasecmp(s->config.encoder_profile, "low-cpu"))
+		target = WHIP_ENCODER_LOW_CPU;
+	/* Find the available encoder with the highest rank for this profile */
+	whip_encoder *encoder = NULL, *e = NULL;
+	int i = 0;
+	for(i = 0; whip_encoders[i].codec != NULL; i++) {
+		e = &whip_encoders[i];
+		if(strcasecmp(e->codec, s->config.video_codec) || e->rank[target] == 0)
+			continue;
+		if(encoder != NULL && encoder->rank[target] >= e->rank[target])
+			continue;
+		if(!whip_element_available(e->element)) {
+			WHIP_LOG(LOG_VERB, "Encoder '%s' not available\n", e->element);
+			continue;
+		}
+		if(!whip_element_available(e->payloader)) {
+			WHIP_LOG(LOG_VERB, "Payloader '%s' not available, can't use '%s'\n", e->payloader, e->element);
+			continue;
+		}
+		encoder = e;
+	}
+	if(encoder == NULL) {
+		WHIP_LOG(LOG_FATAL, "No suitable encoder found for codec '%s' (profile: %s)\n",
+			s->config.video_codec, s->config.encoder_profile);
+		return NULL;
+	}
+	/* Figure out how many threads the encoder should use: if not
+	 * specified, we use up to 4 (2 when aiming at low CPU usage),
+	 * and never more than the cores we've been assigned, if any */
+	int threads = s->config.encoder_threads;
+	if(threads == 0) {
+		threads = s->encode_cpu_count > 0 ? s->encode_cpu_count : (int)g_get_num_processors();
+		threads = MIN(threads, whip_encoder_max_threads(s));
+	}
+	char *props = whip_encoder_expand(s, encoder->props[target], threads);
+	/* If we may need to degrade the video, add elements to scale it: with
+	 * no caps set on the capsfilter, these are all passthrough */
+	const char *scaler = (s->config.degradation != NULL ?
+		" ! videoscale name=whip_video_scaler ! videorate drop-only=true ! capsfilter name=whip_video_degrader" : "");
+	char *pipeline = g_strdup_printf("%s%s ! videoconvert ! queue ! %s %s%s%s ! %s pt=96 %s ! queue ! "
+		"application/x-rtp,media=video,encoding-name=%s,payload=96",
+		source, scaler, encoder->element, props,
+		encoder->caps ? " ! " : "", encoder->caps ? encoder->caps : "",
+		encoder->payloader, encoder->payloader_props, encoder->encoding);
+	g_free(props);
+	WHIP_PREFIX(LOG_INFO, "Picked encoder '%s' for codec '%s' (profile: %s, %d threads)\n",
+		encoder->element, encoder->codec, s->config.encoder_profile, threads);
+	return pipeline;
+}
+
+/* Helper method to send an OPTIONS to the WHIP server to get the STUN/TURN servers */
+static void whip_options(whip_session *s) {
+	s->stun_server = NULL;
+	s->turn_server = NULL;
+	/* Create an HTTP connection */
+	whip_http_session session = { 0 };
+	guint status = whip_http_send(s, &session, "OPTIONS", (char *)s->config.url, NULL, NULL, NULL);
+	if(status != 200 && status != 204) {
+		/* Didn't get the success we were expecting */
+		WHIP_LOG(LOG_WARN, " [%u] %s\n\n", status, status ? soup_message_get_reason_phrase(session.msg) : "HTTP error");
+		g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+		return;
+	}
+	whip_options_links(s, session.msg);
+	g_object_unref(session.msg);
+	g_object_unref(session.http_conn);
+	WHIP_LOG(LOG_INFO, "\n");
+}
+
+/* Helper method to process the Link headers in an OPTIONS response */
+static void whip_options_links(whip_session *s, SoupMessage *msg) {
+	/* Check if there's Link headers with STUN/TURN servers we can use */
+	const char *link = soup_message_headers_get_list(soup_message_get_response_headers(msg), "link");
+	if(link == NULL) {
+		WHIP_LOG(LOG_WARN, "No Link headers in OPTIONS response\n");
+	} else {
+		WHIP_PREFIX(LOG_INFO, "Auto configuration of STUN/TURN servers:\n");
+		int i = 0;
+		gchar **links = g_strsplit(link, ", ", -1);
+		while(links[i] != NULL) {
+			whip_process_link_header(s, links[i]);
+			i++;
+		}
+		g_clear_pointer(&links, g_strfreev);
+	}
+}
+
+/* Endpoint racing: we send an OPTIONS to all endpoints in parallel, and
+ * publish to the one that responds successfully first (i.e., with the
+ * lowest RTT), waiting at most WHIP_RACE_TIMEOUT seconds for responses */
+#define WHIP_RACE_TIMEOUT	5
+typedef struct whip_race_attempt {
+	/* Endpoint, and the OPTIONS we sent */
+	const char *url;
+	SoupMessage *msg;
+	/* When we sent the request, and how long the response took */
+	gint64 sent, rtt;
+	/* Status of the response (0 in case of errors) */
+	guint status;
+	/* Whether the request completed (or failed, or was cancelled) */
+	gboolean done;
+} whip_race_attempt;
+
+/* Callback invoked when one of the OPTIONS in a race completes */
+static void whip_race_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+	whip_race_attempt *attempt = (whip_race_attempt *)user_data;
+	GError *error = NULL;
+	GInputStream *stream = soup_session_send_finish(SOUP_SESSION(source), result, &error);
+	attempt->done = TRUE;
+	if(stream != NULL)
+		g_object_unref(stream);
+	if(error != NULL) {
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			WHIP_PREFIX(LOG_WARN, "  -- %s: %s\n", attempt->url, error->message);
+		g_error_free(error);
+		return;
+	}
+	attempt->rtt = g_get_monotonic_time() - attempt->sent;
+	attempt->status = soup_message_get_status(attempt->msg);
+	WHIP_PREFIX(LOG_INFO, "  -- %s: [%u] in %.2fms\n", attempt->url, attempt->status,
+		(double)attempt->rtt / 1000);
+}
+
+/* Timer callback to stop waiting for a race */
+static gboolean whip_race_timeout(gpointer user_data) {
+	gboolean *expired = (gboolean *)user_data;
+	*expired = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+/* Helper method to race the endpoints, and pick the fastest: returns TRUE
+ * if the Link headers (STUN/TURN servers) were processed too */
+static gboolean whip_race(whip_session *s) {
+	int count = 1, i = 0;
+	while(s->config.race_urls[count-1] != NULL)
+		count++;
+	WHIP_PREFIX(LOG_INFO, "Racing %d WHIP endpoints:\n", count);
+	/* We use a dedicated context, so that we can wait for the responses here */
+	GMainContext *context = g_main_context_new();
+	g_main_context_push_thread_default(context);
+	SoupSession *http_conn = s->http ? g_object_ref(s->http) : whip_http_session_new(s);
+	GCancellable *cancellable = g_cancellable_new();
+	whip_race_attempt *attempts = g_malloc0(count * sizeof(whip_race_attempt));
+	for(i = 0; i < count; i++) {
+		whip_race_attempt *attempt = &attempts[i];
+		attempt->url = (i == 0 ? s->config.url : s->config.race_urls[i-1]);
+		attempt->msg = whip_http_message(s, "OPTIONS", attempt->url, NULL, NULL);
+		if(attempt->msg == NULL) {
+			WHIP_LOG(LOG_WARN, "Invalid WHIP endpoint '%s', skipping...\n", attempt->url);
+			attempt->done = TRUE;
+			continue;
+		}
+		attempt->sent = g_get_monotonic_time();
+		soup_session_send_async(http_conn, attempt->msg, G_PRIORITY_DEFAULT,
+			cancellable, whip_race_done, attempt);
+	}
+	/* Wait for the first successful response (405 is fine too, as it just
+	 * means the endpoint doesn't implement OPTIONS), or for a timeout: errors
+	 * like 401, 404 or 503 mean that endpoint is not one we can publish to.
+	 * As more responses may be handled in the same iteration, the winner is
+	 * the successful one with the lowest RTT, not the first in the list */
+	gboolean expired = FALSE, pending = TRUE;
+	GSource *timer = g_timeout_source_new_seconds(WHIP_RACE_TIMEOUT);
+	g_source_set_callback(timer, whip_race_timeout, &expired, NULL);
+	g_source_attach(timer, context);
+	whip_race_attempt *winner = NULL;
+	while(winner == NULL && pending && !expired) {
+		g_main_context_iteration(context, TRUE);
+		pending = FALSE;
+		for(i = 0; i < count; i++) {
+			if(!attempts[i].done) {
+				pending = TRUE;
+			} else if((SOUP_STATUS_IS_SUCCESSFUL(attempts[i].status) || attempts[i].status == 405) &&
+					(winner == NULL || attempts[i].rtt < winner->rtt)) {
+				winner = &attempts[i];
+			}
+		}
+	}
+	g_source_destroy(timer);
+	g_source_unref(timer);
+	/* Abandon the losers, and wait for the cancellations to complete */
+	g_cancellable_cancel(cancellable);
+	while(pending) {
+		g_main_context_iteration(context, TRUE);
+		pending = FALSE;
+		for(i = 0; i < count; i++) {
+			if(!attempts[i].done)
+				pending = TRUE;
+		}
+	}
+	gboolean links = FALSE;
+	if(winner == NULL) {
+		WHIP_LOG(LOG_WARN, "No WHIP endpoint responded successfully, sticking to %s\n", s->config.url);
+	} else {
+		WHIP_PREFIX(LOG_INFO, "Publishing to %s\n", winner->url);
+		whip_http_metrics(s, winner->msg);
+		s->config.url = winner->url;
+		if(s->config.follow_link && (winner->status == 200 || winner->status == 204)) {
+			/* We can configure STUN/TURN servers using this response */
+			s->stun_server = NULL;
+			s->turn_server = NULL;
+			whip_options_links(s, winner->msg);
+			links = TRUE;
+		}
+	}
+	WHIP_LOG(LOG_INFO, "\n");
+	for(i = 0; i < count; i++) {
+		if(attempts[i].msg != NULL)
+			g_object_unref(attempts[i].msg);
+	}
+	g_free(attempts);
+	g_object_unref(cancellable);
+	g_object_unref(http_conn);
+	g_main_context_pop_thread_default(context);
+	g_main_context_unref(context);
+	return links;
+}
+
+/* Pad probe on the EOS sink, to tear down the session when we get an EOS */
+static GstPadProbeReturn whip_eos_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+	if(event != NULL && GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+		g_atomic_int_set(&s->stopping, 1);
+		whip_disconnect(s, "Shutting down (EOS)");
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+/* Helper method to initialize the GStreamer WebRTC stack */
+static gboolean whip_initialize(whip_session *s) {
+	if(s->pc == NULL) {
+		/* Prepare the pipeline, using the info we got from the configuration */
+		const char *audio_pipe = s->config.audio_pipe;
+		const char *video_pipe = s->auto_video_pipe ? s->auto_video_pipe : s->config.video_pipe;
+		char audio[2048], video[2048], gst_pipeline[4096];
+		/* If we may need to fail over, we'll feed PeerConnections via tees */
+		gboolean failover = (s->config.backup_urls != NULL && s->config.backup_urls[0] != NULL);
+		audio[0] = '\0';
+		if(audio_pipe != NULL && failover) {
+			g_snprintf(audio, sizeof(audio), "%s ! tee name=whip_audio_tee allow-not-linked=true "
+				"whip_audio_tee. ! queue ! valve name=whip_audio_valve ! sendonly.", audio_pipe);
+		} else if(audio_pipe != NULL) {
+			g_snprintf(audio, sizeof(audio), "%s ! sendonly.", audio_pipe);
+		}
+		video[0] = '\0';
+		/* If we need to pace video, packets go through a dedicated queue */
+		const char *pacer = (s->config.pacing_factor > 0 ?
+			" ! queue name=whip_video_pacer max-size-buffers=0 max-size-bytes=0 max-size-time=2000000000" : "");
+		if(video_pipe != NULL && failover) {
+			/* The pacer goes before the tee, so that it works for backup sessions too */
+			g_snprintf(video, sizeof(video), "%s%s ! tee name=whip_video_tee allow-not-linked=true "
+				"whip_video_tee. ! queue ! valve name=whip_video_valve ! sendonly.", video_pipe, pacer);
+		} else if(video_pipe != NULL) {
+			g_snprintf(video, sizeof(video), "%s%s ! sendonly.", video_pipe, pacer);
+		}
+		g_snprintf(gst_pipeline, sizeof(gst_pipeline), "webrtcbin name=sendonly bundle-policy=%d %s %s",
+			(audio_pipe && video_pipe ? 3 : 0), video, audio);
+		/* Launch the pipeline */
+		WHIP_PREFIX(LOG_INFO, "Initializing the GStreamer pipeline:\n%s\n", gst_pipeline);
+		GError *error = NULL;
+		s->pipeline = gst_parse_launch(gst_pipeline, &error);
+		if(error) {
+			WHIP_LOG(LOG_ERR, "Failed to parse/launch the pipeline: %s\n", error->message);
+			g_error_free(error);
+			goto err;
+		}
+		s->owned = TRUE;
+		s->bin = GST_BIN(s->pipeline);
+		/* Get a pointer to the PeerConnection object */
+		s->pc = gst_bin_get_by_name(GST_BIN(s->pipeline), "sendonly");
+		g_assert_nonnull(s->pc);
+		if(failover) {
+			/* Keep track of the tees and valves, in case we need to switch */
+			s->tees[0] = gst_bin_get_by_name(s->bin, "whip_audio_tee");
+			s->tees[1] = gst_bin_get_by_name(s->bin, "whip_video_tee");
+			s->valves = g_ptr_array_new_with_free_func((GDestroyNotify)gst_object_unref);
+			GstElement *valve = gst_bin_get_by_name(s->bin, "whip_audio_valve");
+			if(valve != NULL)
+				g_ptr_array_add(s->valves, valve);
+			valve = gst_bin_get_by_name(s->bin, "whip_video_valve");
+			if(valve != NULL)
+				g_ptr_array_add(s->valves, valve);
+		}
+	} else if(s->config.backup_urls != NULL && s->config.backup_urls[0] != NULL) {
+		WHIP_LOG(LOG_WARN, "Can't fail over in a pipeline we don't own, ignoring backup endpoints\n");
+		s->config.backup_urls = NULL;
+	}
+	if(s->config.pacing_factor > 0) {
+		if(s->owned)
+			whip_pacer_setup(s);
+		else
+			WHIP_LOG(LOG_WARN, "Can't pace packets in a pipeline we don't own\n");
+	}
+	/* Backup sessions only munge the SDP: the Opus encoder is tuned by the
+	 * primary session, according to the loss of the active PeerConnection */
+	if(s->config.audio_profile != NULL && s->primary == NULL)
+		whip_opus_setup(s);
+	if(s->config.degradation != NULL)
+		whip_degradation_setup(s);
+
+	if(s->config.eos_sink_name != NULL) {
+		GstElement *eossrc = gst_bin_get_by_name(s->bin, s->config.eos_sink_name);
+		GstPad *sinkpad = eossrc ? gst_element_get_static_pad(eossrc, "sink") : NULL;
+		if(sinkpad == NULL) {
+			WHIP_LOG(LOG_WARN, "No sink '%s' to monitor for EOS\n", s->config.eos_sink_name);
+		} else {
+			gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, whip_eos_probe, s, NULL);
+			gst_object_unref(sinkpad);
+		}
+		if(eossrc != NULL)
+			gst_object_unref(eossrc);
+	}
+
+	/* If we have a CPU budget, enforce it on encoders and streaming threads */
+	if(s->encode_cpu_count > 0 || s->network_cpu_count > 0 || s->config.encoder_threads > 0) {
+		if(s->encode_cpu_count > 0 || s->config.encoder_threads > 0)
+			whip_foreach_element(s->bin, (GstIteratorForeachFunction)whip_encoder_set_threads, s);
+		if(s->owned) {
+			GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(s->pipeline));
+			gst_bus_set_sync_handler(bus, whip_bus_sync_handler, s, NULL);
+			gst_object_unref(bus);
+		} else if(s->encode_cpu_count > 0 || s->network_cpu_count > 0) {
+			WHIP_LOG(LOG_WARN, "Can't pin streaming threads in a pipeline we don't own\n");
+		}
+	}
+
+	/* If we have a persistent DTLS certificate, make sure it's used */
+	if(s->config.dtls_pem != NULL)
+		whip_dtls_setup(s);
+
+	/* Configure the PeerConnection and its callbacks */
+	whip_configure_webrtcbin(s);
+
+	if(s->owned) {
+		/* Prepare the pipeline */
+		gst_element_set_state(s->pipeline, GST_STATE_READY);
+		/* Now that sources have been opened, check if we can avoid copies */
+		if(s->config.zero_copy)
+			whip_zero_copy_setup(s);
+	} else if(s->config.zero_copy) {
+		WHIP_LOG(LOG_WARN, "Can't optimize allocations in a pipeline we don't own\n");
+	}
+
+	/* If we need to measure the latency, add the probes now */
+	if(s->config.latency_probe)
+		whip_latency_setup(s);
+	/* The same applies to profiling */
+	if(s->config.profile)
+		whip_profile_setup(s);
+
+	if(s->owned) {
+		/* Start the pipeline */
+		WHIP_PREFIX(LOG_INFO, "Starting the GStreamer pipeline\n");
+		GstStateChangeReturn ret = gst_element_set_state(GST_ELEMENT(s->pipeline), GST_STATE_PLAYING);
+		if(ret == GST_STATE_CHANGE_FAILURE) {
+			WHIP_LOG(LOG_ERR, "Failed to set the pipeline state to playing\n");
+			goto err;
+		}
+	}
+
+	/* Done */
+	return TRUE;
+
+err:
+	/* If we got here, something went wrong */
+	if(s->pc) {
+		g_signal_handlers_disconnect_by_data(s->pc, s);
+		gst_object_unref(s->pc);
+		s->pc = NULL;
+	}
+	if(s->pipeline) {
+		gst_element_set_state(s->pipeline, GST_STATE_NULL);
+		g_clear_object(&s->pipeline);
+	}
+	s->bin = NULL;
+	return FALSE;
+}
+
+/* Helper method to configure webrtcbin (STUN/TURN, callbacks, latency) */
+static void whip_configure_webrtcbin(whip_session *s) {
+	/* Check if there's any STUN server to use */
+	const char *stun_server = s->stun_server ? s->stun_server : s->auto_stun_server;
+	if(stun_server != NULL)
+		g_object_set(s->pc, "stun-server", stun_server, NULL);
+	if(s->config.force_turn)
+		g_object_set(s->pc, "ice-transport-policy", GST_WEBRTC_ICE_TRANSPORT_POLICY_RELAY, NULL);
+	/* Check if there's any TURN server to add */
+	if((s->turn_server != NULL && s->turn_server[0] != NULL) ||
+			(s->auto_turn_server != NULL && s->auto_turn_server[0] != NULL)) {
+		int i=0;
+		gboolean ret = FALSE;
+		char *ts = NULL;
+		while((ts = s->turn_server ? (char *)s->turn_server[i] : s->auto_turn_server[i]) != NULL) {
+			if(strstr(ts, "turn://") != ts && strstr(ts, "turns://") != ts) {
+				/* Invalid TURN server, skip */
+			} else {
+				g_signal_emit_by_name(s->pc, "add-turn-server", ts, &ret);
+				if(!ret)
+					WHIP_LOG(LOG_WARN, "Error adding TURN server (%s)\n", ts);
+			}
+			i++;
+		}
+	}
+	/* Restrict the candidates the ICE agent gathers, if needed */
+	whip_ice_filters_setup(s);
+	/* Check if we need to use a specific port range */
+	if(s->config.ice_min_port > 0 || s->config.ice_max_port > 0) {
+#if GST_CHECK_VERSION(1, 22, 0)
+		GObject *ice = NULL;
+		g_object_get(s->pc, "ice-agent", &ice, NULL);
+		if(ice != NULL) {
+			if(s->config.ice_min_port > 0)
+				g_object_set(ice, "min-rtp-port", s->config.ice_min_port, NULL);
+			if(s->config.ice_max_port > 0)
+				g_object_set(ice, "max-rtp-port", s->config.ice_max_port, NULL);
+			guint min_port = 0, max_port = 0;
+			g_object_get(ice, "min-rtp-port", &min_port, "max-rtp-port", &max_port, NULL);
+			WHIP_PREFIX(LOG_INFO, "Using ports %u-%u for ICE\n", min_port, max_port);
+			g_object_unref(ice);
+		}
+#else
+		WHIP_LOG(LOG_WARN, "Setting the ICE port range requires GStreamer >= 1.22, ignoring it\n");
+#endif
+	}
+	/* Let's configure the function to be invoked when an SDP offer can be prepared */
+	g_signal_connect(s->pc, "on-negotiation-needed", G_CALLBACK(whip_negotiation_needed), s);
+	/* We need a different callback to be notified about candidates to trickle to Janus */
+	g_signal_connect(s->pc, "on-ice-candidate", G_CALLBACK(whip_candidate), s);
+	/* We also add a couple of callbacks to be notified about connection state changes */
+	g_signal_connect(s->pc, "notify::connection-state", G_CALLBACK(whip_connection_state), s);
+	g_signal_connect(s->pc, "notify::ice-gathering-state", G_CALLBACK(whip_ice_gathering_state), s);
+	g_signal_connect(s->pc, "notify::ice-connection-state", G_CALLBACK(whip_ice_connection_state), s);
+
+	/* If a latency value has been passed as an argument, enforce it */
+	GstElement *rtpbin = gst_bin_get_by_name(GST_BIN(s->pc), "rtpbin");
+	if(s->config.latency >= 0)
+		g_object_set(rtpbin, "latency", s->config.latency, "buffer-mode", 0, NULL);
+	guint rtp_latency = 0;
+	g_object_get(rtpbin, "latency", &rtp_latency, NULL);
+	WHIP_PREFIX(LOG_INFO, "Configured jitter-buffer size (latency) for PeerConnection to %ums\n", rtp_latency);
+	gst_object_unref(rtpbin);
+}
+
+/* Callback invoked when we need to prepare an SDP offer */
+static void whip_negotiation_needed(GstElement *element, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(s->resource_url != NULL) {
+		/* We've sent an offer already, is something wrong? */
+		WHIP_LOG(LOG_WARN, "GStreamer trying to create a new offer, but we don't support renegotiations yet...\n");
+		return;
+	}
+	/* Now that we have transceivers, we know how to mark packets, if needed */
+	if(s->config.dscp && s->udp_dscp == 0)
+		whip_dscp_setup(s);
+	WHIP_PREFIX(LOG_INFO, "Creating offer\n");
+	s->state = WHIP_STATE_OFFER_PREPARED;
+	GstPromise *promise = gst_promise_new_with_change_func(whip_offer_available, s, NULL);
+	g_signal_emit_by_name(s->pc, "create-offer", NULL, promise);
+}
+
+/* Callback invoked when we have an SDP offer ready to be sent */
+static void whip_offer_available(GstPromise *promise, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	WHIP_PREFIX(LOG_INFO, "Offer created\n");
+	/* Make sure we're in the right state */
+	g_assert_cmphex(s->state, ==, WHIP_STATE_OFFER_PREPARED);
+	g_assert_cmphex(gst_promise_wait(promise), ==, GST_PROMISE_RESULT_REPLIED);
+	const GstStructure *reply = gst_promise_get_reply(promise);
+	gst_structure_get(reply, "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &s->offer, NULL);
+	gst_promise_unref(promise);
+	/* Advertise the Opus features we're using, if needed */
+	if(s->opusenc != NULL)
+		whip_opus_munge_sdp(s, s->offer->sdp);
+	/* Make sure nothing else ended up using the NTP-64 extension ID */
+	if(s->latency_ext_id > 0)
+		whip_latency_check_extmap(s, s->offer->sdp);
+
+	/* Set the local description locally */
+	WHIP_PREFIX(LOG_INFO, "Setting local description\n");
+	promise = gst_promise_new();
+	g_signal_emit_by_name(s->pc, "set-local-description", s->offer, promise);
+	gst_promise_interrupt(promise);
+	gst_promise_unref(promise);
+
+	/* Now that a DTLS stack is available, try monitoring the DTLS state too */
+	GstElement *dtls = gst_bin_get_by_name(GST_BIN(s->pc), "dtlsdec0");
+	if(dtls != NULL) {
+		g_signal_connect(dtls, "notify::connection-state", G_CALLBACK(whip_dtls_connection_state), s);
+		gst_object_unref(dtls);
+	}
+
+	/* Now that the offer is ready, connect to the WHIP endpoint and send it there
+	 * (unless we're not tricking, in which case we wait for gathering to be
+	 * completed, and then add all candidates to this offer before sending it) */
+	whip_maybe_connect(s);
+}
+
+/* Helper method to send the offer, if we're ready to publish */
+static void whip_maybe_connect(whip_session *s) {
+	g_mutex_lock(&s->mutex);
+	if(s->offer == NULL) {
+		g_mutex_unlock(&s->mutex);
+		return;
+	}
+	/* When not trickling, or in standby, we wait for gathering to be completed */
+	if((s->config.no_trickle || s->config.standby) && !s->gathering_done) {
+		g_mutex_unlock(&s->mutex);
+		return;
+	}
+	if(!s->publish) {
+		/* Everything's ready, wait for the trigger */
+		g_mutex_unlock(&s->mutex);
+		WHIP_PREFIX(LOG_INFO, "Offer and candidates ready, waiting for the trigger to publish\n");
+		whip_set_state(s, WHIP_SESSION_READY);
+		return;
+	}
+	GstWebRTCSessionDescription *offer = s->offer;
+	s->offer = NULL;
+	g_mutex_unlock(&s->mutex);
+	whip_connect(s, offer);
+	gst_webrtc_session_description_free(offer);
+}
+
+/* Callback invoked when a candidate to trickle becomes available */
+static void whip_candidate(GstElement *webrtc G_GNUC_UNUSED,
+		guint mlineindex, char *candidate, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->stopping) || g_atomic_int_get(&s->disconnected))
+		return;
+	/* Make sure we're in the right state*/
+	if(s->state < WHIP_STATE_OFFER_PREPARED) {
+		whip_disconnect(s, "Can't trickle, not in a PeerConnection");
+		return;
+	}
+	if(mlineindex != 0) {
+		/* We're bundling, so we don't care */
+		return;
+	}
+	int component = 0;
+	gchar **parts = g_strsplit(candidate, " ", -1);
+	if(parts[0] && parts[1])
+		component = atoi(parts[1]);
+	g_strfreev(parts);
+	if(component != 1) {
+		/* We're bundling, so we don't care */
+		return;
+	}
+	if(!whip_candidate_allowed(s, candidate)) {
+		WHIP_PREFIX(LOG_VERB, "Filtering out candidate: %s\n", candidate);
+		return;
+	}
+	/* Keep track of the candidate, we'll send it later when the timer fires */
+	g_async_queue_push(s->candidates, g_strdup(candidate));
+}
+
+/* Helper method to send candidates via HTTP PATCH */
+static gboolean whip_send_candidates(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(s->candidates == NULL || g_async_queue_length(s->candidates) == 0)
+		return TRUE;
+	/* Prepare the fragment to send (credentials + fake mline + candidate) */
+	char fragment[4096];
+	g_snprintf(fragment, sizeof(fragment),
+		"a=ice-ufrag:%s\r\n"
+		"a=ice-pwd:%s\r\n"
+		"m=%s 9 RTP/AVP 0\r\n", s->ice_ufrag, s->ice_pwd,
+		s->first_media ? s->first_media : (s->config.audio_pipe ? "audio" : "video"));
+	if(s->first_mid) {
+		g_strlcat(fragment, "a=mid:", sizeof(fragment));
+		g_strlcat(fragment, s->first_mid, sizeof(fragment));
+		g_strlcat(fragment, "\r\n", sizeof(fragment));
+	}
+	char *candidate = NULL;
+	while((candidate = g_async_queue_try_pop(s->candidates)) != NULL) {
+		WHIP_PREFIX(LOG_VERB, "Sending candidates: %s\n", candidate);
+		g_strlcat(fragment, "a=", sizeof(fragment));
+		g_strlcat(fragment, candidate, sizeof(fragment));
+		g_strlcat(fragment, "\r\n", sizeof(fragment));
+		g_free(candidate);
+	}
+	/* Send the candidate via a PATCH message */
+	if(s->resource_url == NULL) {
+		WHIP_LOG(LOG_WARN, "No resource url, can't trickle...\n");
+		return TRUE;
+	}
+	/* Queue the batch: it's sent right away, unless too many PATCH
+	 * requests are in flight already, or we're backing off */
+	whip_trickle_batch *batch = g_malloc0(sizeof(whip_trickle_batch));
+	batch->s = s;
+	batch->fragment = g_strdup(fragment);
+	batch->etag = g_strdup(s->latest_etag);
+	g_queue_push_tail(s->trickle_queue, batch);
+	whip_trickle_flush(s);
+	/* If the candidates we sent included an end-of-candidates, let's stop here */
+	if(strstr(fragment, "end-of-candidates") != NULL)
+		return FALSE;
+	return TRUE;
+}
+
+/* Callback invoked when a trickle PATCH request completes */
+static void whip_trickle_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+	whip_trickle_batch *batch = (whip_trickle_batch *)user_data;
+	GError *error = NULL;
+	GBytes *bytes = soup_session_send_and_read_finish(SOUP_SESSION(source), result, &error);
+	if(bytes != NULL)
+		g_bytes_unref(bytes);
+	if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* The session is going away, don't touch it */
+		g_error_free(error);
+		whip_trickle_batch_free(batch);
+		return;
+	}
+	whip_session *s = batch->s;
+	s->trickle_inflight--;
+	guint status = error ? 0 : soup_message_get_status(batch->msg);
+	if(error == NULL)
+		whip_http_metrics(s, batch->msg);
+	if(g_atomic_int_get(&s->stopping) || g_atomic_int_get(&s->disconnected)) {
+		g_clear_error(&error);
+		whip_trickle_batch_free(batch);
+		return;
+	}
+	if((status == 301 || status == 307) && batch->redirects < WHIP_REDIRECTS_MAX) {
+		/* Redirected: remember where, and send the batch again */
+		const char *location = soup_message_headers_get_one(soup_message_get_response_headers(batch->msg), "location");
+		if(location != NULL) {
+			char *requested = g_uri_to_string(soup_message_get_uri(batch->msg));
+			char *target = whip_redirect_resolve(requested, location);
+			if(target != NULL) {
+				batch->redirects++;
+				WHIP_LOG(LOG_INFO, "  -- Redirected to %s\n", target);
+				whip_redirect_store(s, requested, target, status == 301);
+				g_free(target);
+				g_free(requested);
+				g_clear_object(&batch->msg);
+				g_queue_push_head(s->trickle_queue, batch);
+				whip_trickle_flush(s);
+				return;
+			}
+			g_free(requested);
+		}
+	}
+	if(status == 200 || status == 204) {
+		/* Done */
+		whip_trickle_batch_free(batch);
+	} else if(status == 412) {
+		/* The ETag changed (e.g., ICE restart), so these candidates are stale */
+		WHIP_LOG(LOG_WARN, " [trickle] 412 %s, dropping stale candidates\n",
+			soup_message_get_reason_phrase(batch->msg));
+		whip_trickle_batch_free(batch);
+	} else if((status == 0 || status == 429 || status >= 500) && batch->attempts < WHIP_TRICKLE_RETRIES) {
+		/* Try again later: since we only have one request in flight at a time,
+		 * nothing else is sent in the meanwhile, and so the server still gets
+		 * the candidates in order */
+		guint backoff = 100 << batch->attempts;
+		batch->attempts++;
+		WHIP_LOG(LOG_WARN, " [trickle] %u %s, retrying in %ums\n", status,
+			status ? soup_message_get_reason_phrase(batch->msg) : (error ? error->message : "HTTP error"), backoff);
+		g_clear_object(&batch->msg);
+		g_queue_push_head(s->trickle_queue, batch);
+		s->trickle_hold = TRUE;
+		whip_add_timeout(s, backoff, whip_trickle_retry);
+		g_clear_error(&error);
+		return;
+	} else {
+		/* Couldn't trickle? */
+		WHIP_LOG(LOG_WARN, " [trickle] %u %s\n", status,
+			status ? soup_message_get_reason_phrase(batch->msg) : (error ? error->message : "HTTP error"));
+		whip_trickle_batch_free(batch);
+	}
+	g_clear_error(&error);
+	whip_trickle_flush(s);
+}
+
+/* Timer callback to resume trickling after a backoff */
+static gboolean whip_trickle_retry(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	s->trickle_hold = FALSE;
+	whip_trickle_flush(s);
+	return G_SOURCE_REMOVE;
+}
+
+/* Helper method to send the next queued trickle batch, if none is in flight */
+static void whip_trickle_flush(whip_session *s) {
+	if(s->trickle_hold || s->resource_url == NULL)
+		return;
+	if(s->trickle_http == NULL)
+		s->trickle_http = s->http ? g_object_ref(s->http) : whip_http_session_new(s);
+	while(s->trickle_inflight == 0 && !g_queue_is_empty(s->trickle_queue)) {
+		whip_trickle_batch *batch = g_queue_pop_head(s->trickle_queue);
+		if(g_strcmp0(batch->etag, s->latest_etag)) {
+			/* Prepared for a different ETag (e.g., before an ICE restart), drop it */
+			WHIP_LOG(LOG_VERB, " [trickle] Dropping candidates for a previous ETag\n");
+			whip_trickle_batch_free(batch);
+			continue;
+		}
+		char *url = whip_redirect_lookup(s, s->resource_url);
+		batch->msg = whip_http_message(s, "PATCH", url ? url : s->resource_url,
+			batch->fragment, "application/trickle-ice-sdpfrag");
+		g_free(url);
+		s->trickle_inflight++;
+		soup_session_send_and_read_async(s->trickle_http, batch->msg, G_PRIORITY_DEFAULT,
+			s->trickle_cancellable, whip_trickle_done, batch);
+	}
+}
+
+/* Callback invoked when the connection state changes */
+static void whip_connection_state(GstElement *webrtc, GParamSpec *pspec,
+		gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	guint state = 0;
+	g_object_get(webrtc, "connection-state", &state, NULL);
+	switch(state) {
+		case 1:
+			WHIP_PREFIX(LOG_INFO, "PeerConnection connecting...\n");
+			break;
+		case 2:
+			WHIP_PREFIX(LOG_INFO, "PeerConnection connected\n");
+			whip_set_state(s, WHIP_SESSION_CONNECTED);
+			/* Now that we know which socket we use for media, tune it */
+			g_main_context_invoke(s->context, whip_udp_setup, s);
+			/* If we need a hot standby, negotiate it now */
+			if(s->config.hot_standby && s->config.backup_urls != NULL && s->valves != NULL && s->backup == NULL)
+				g_main_context_invoke(s->context, whip_failover_standby, s);
+			break;
+		case 4:
+			WHIP_PREFIX(LOG_ERR, "PeerConnection failed\n");
+			whip_disconnect(s, "PeerConnection failed");
+			break;
+		case 0:
+		case 3:
+		case 5:
+		default:
+			/* We don't care (we should in case of restarts?) */
+			break;
+	}
+}
+
+/* Callback invoked when the ICE gathering state changes */
+static void whip_ice_gathering_state(GstElement *webrtc, GParamSpec *pspec,
+		gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	guint state = 0;
+	g_object_get(webrtc, "ice-gathering-state", &state, NULL);
+	switch(state) {
+		case 1:
+			WHIP_PREFIX(LOG_INFO, "ICE gathering started...\n");
+			break;
+		case 2:
+			WHIP_PREFIX(LOG_INFO, "ICE gathering completed\n");
+			/* Send an a=end-of-candidates trickle */
+			g_async_queue_push(s->candidates, g_strdup("end-of-candidates"));
+			s->gathering_done = TRUE;
+			/* If we're not trickling, send the SDP with all candidates now */
+			whip_maybe_connect(s);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Callback invoked when the ICE connection state changes */
+static void whip_ice_connection_state(GstElement *webrtc, GParamSpec *pspec,
+		gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	guint state = 0;
+	g_object_get(webrtc, "ice-connection-state", &state, NULL);
+	switch(state) {
+		case 1:
+			WHIP_PREFIX(LOG_INFO, "ICE connecting...\n");
+			break;
+		case 2:
+			WHIP_PREFIX(LOG_INFO, "ICE connected\n");
+			break;
+		case 3:
+			WHIP_PREFIX(LOG_INFO, "ICE completed\n");
+			break;
+		case 4:
+			WHIP_PREFIX(LOG_ERR, "ICE failed\n");
+			whip_disconnect(s, "ICE failed");
+			break;
+		case 0:
+		case 5:
+		default:
+			/* We don't care (we should in case of restarts?) */
+			break;
+	}
+}
+
+/* Callback invoked when the DTLS connection state changes */
+static void whip_dtls_connection_state(GstElement *dtls, GParamSpec *pspec,
+		gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	guint state = 0;
+	g_object_get(dtls, "connection-state", &state, NULL);
+	switch(state) {
+		case 1:
+			WHIP_PREFIX(LOG_INFO, "DTLS connection closed\n");
+			whip_disconnect(s, "PeerConnection closed");
+			break;
+		case 2:
+			WHIP_PREFIX(LOG_ERR, "DTLS failed\n");
+			whip_disconnect(s, "DTLS failed");
+			break;
+		case 3:
+			WHIP_PREFIX(LOG_INFO, "DTLS connecting...\n");
+			break;
+		case 4:
+			WHIP_PREFIX(LOG_INFO, "DTLS connected\n");
+			break;
+		default:
+			/* We don't care (we should in case of restarts?) */
+			break;
+	}
+}
+
+/* Helper method to connect to the WHIP endpoint */
+static void whip_connect(whip_session *s, GstWebRTCSessionDescription *offer) {
+	/* Convert the SDP object to a string */
+	char *sdp_offer = gst_sdp_message_as_text(offer->sdp);
+	WHIP_PREFIX(LOG_INFO, "Sending SDP offer (%zu bytes)\n", strlen(sdp_offer));
+
+	/* If we're not trickling, add our candidates to the SDP (we do the
+	 * same in standby mode, as we've gathered them all already anyway) */
+	gboolean full_sdp = (s->config.no_trickle || s->gathering_done);
+	if(full_sdp) {
+		/* Prepare the candidate attributes */
+		char attributes[4096], expanded_sdp[8192];
+		attributes[0] = '\0';
+		expanded_sdp[0] = '\0';
+		char *candidate = NULL;
+		while((candidate = g_async_queue_try_pop(s->candidates)) != NULL) {
+			WHIP_PREFIX(LOG_VERB, "Adding candidate to SDP: %s\n", candidate);
+			g_strlcat(attributes, "a=", sizeof(attributes));
+			g_strlcat(attributes, candidate, sizeof(attributes));
+			g_strlcat(attributes, "\r\n", sizeof(attributes));
+			g_free(candidate);
+		}
+		/* Add them to all m-lines */
+		int mlines = 0, i = 0;
+		gchar **lines = g_strsplit(sdp_offer, "\r\n", -1);
+		gchar *line = NULL;
+		while(lines[i] != NULL) {
+			line = lines[i];
+			if(strstr(line, "m=") == line) {
+				/* New m-line */
+				mlines++;
+				if(mlines > 1)
+					g_strlcat(expanded_sdp, attributes, sizeof(expanded_sdp));
+			}
+			if(strlen(line) > 2) {
+				g_strlcat(expanded_sdp, line, sizeof(expanded_sdp));
+				g_strlcat(expanded_sdp, "\r\n", sizeof(expanded_sdp));
+			}
+			i++;
+		}
+		g_clear_pointer(&lines, g_strfreev);
+		g_strlcat(expanded_sdp, attributes, sizeof(expanded_sdp));
+		g_free(sdp_offer);
+		sdp_offer = g_strdup(expanded_sdp);
+	}
+	/* Turn sendrecv to sendonly, as some servers seem to barf on it otherwise */
+	char *sr = NULL;
+	const char *so = "sendonly";
+	while((sr = strstr(sdp_offer, "sendrecv")) != NULL)
+		memcpy(sr, so, 8);
+	/* Done */
+	WHIP_LOG(LOG_VERB, "%s\n", sdp_offer);
+
+	/* Partially parse the SDP to find ICE credentials and the mid for the bundle m-line */
+	if(!whip_parse_offer(s, sdp_offer)) {
+		g_free(sdp_offer);
+		whip_disconnect(s, "SDP error");
+		return;
+	}
+
+	/* Create an HTTP connection */
+	whip_set_state(s, WHIP_SESSION_CONNECTING);
+	whip_http_session session = { 0 };
+	GBytes *bytes = NULL;
+	guint status = whip_http_send(s, &session, "POST", (char *)s->config.url, sdp_offer, "application/sdp", &bytes);
+	g_free(sdp_offer);
+	if(status != 201) {
+		/* Didn't get the success we were expecting */
+		WHIP_LOG(LOG_ERR, " [%u] %s\n", status, status ? soup_message_get_reason_phrase(session.msg) : "HTTP error");
+		g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+		if(bytes != NULL)
+			g_bytes_unref(bytes);
+		whip_disconnect(s, "HTTP error");
+		return;
+	}
+	/* Get the response */
+	const char *content_type = soup_message_headers_get_content_type(soup_message_get_response_headers(session.msg), NULL);
+	if(content_type == NULL || strcasecmp(content_type, "application/sdp")) {
+		WHIP_LOG(LOG_ERR, "Unexpected content-type '%s'\n", content_type);
+		g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+		if(bytes != NULL)
+			g_bytes_unref(bytes);
+		whip_disconnect(s, "HTTP error");
+		return;
+	}
+	/* Get the body */
+	if(bytes == NULL || g_bytes_get_size(bytes) == 0) {
+		WHIP_LOG(LOG_ERR, "Missing SDP answer\n");
+		g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+		if(bytes != NULL)
+			g_bytes_unref(bytes);
+		whip_disconnect(s, "SDP error");
+		return;
+	}
+	char *answer = g_malloc(g_bytes_get_size(bytes) + 1);
+	memcpy(answer, g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes));
+	answer[g_bytes_get_size(bytes)] = '\0';
+	g_bytes_unref(bytes);
+	if(strstr(answer, "v=0\r\n") != answer) {
+		WHIP_LOG(LOG_ERR, "Invalid SDP answer\n");
+		g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+		g_free(answer);
+		whip_disconnect(s, "SDP error");
+		return;
+	}
+	/* Check if there's an ETag we should send in upcoming requests */
+	const char *etag = soup_message_headers_get_one(soup_message_get_response_headers(session.msg), "etag");
+	if(etag == NULL) {
+		WHIP_LOG(LOG_WARN, "No ETag header, won't be able to set If-Match when trickling\n");
+	} else {
+		s->latest_etag = g_strdup(etag);
+	}
+	/* Parse the location header to populate the resource url */
+	const char *location = soup_message_headers_get_one(soup_message_get_response_headers(session.msg), "location");
+	if(location == NULL) {
+		WHIP_LOG(LOG_WARN, "No Location header, won't be able to trickle or teardown the session\n");
+	} else {
+		if(strstr(location, "http")) {
+			/* Easy enough */
+			s->resource_url = g_strdup(location);
+		} else {
+			/* Relative path (to the endpoint we were redirected to, if any) */
+			char *endpoint = whip_redirect_lookup(s, s->config.url);
+			GUri *l_uri = g_uri_parse(endpoint ? endpoint : s->config.url, SOUP_HTTP_URI_FLAGS, NULL);
+			g_free(endpoint);
+			GUri *uri = NULL;
+			if(location[0] == '/') {
+				/* Use the full returned path as new path */
+				uri = g_uri_build(SOUP_HTTP_URI_FLAGS,
+					g_uri_get_scheme(l_uri),
+					g_uri_get_userinfo(l_uri),
+					g_uri_get_host(l_uri),
+					g_uri_get_port(l_uri),
+					location, NULL, NULL);
+			} else {
+				/* Relative url, build the resource url accordingly */
+				const char *endpoint_path = g_uri_get_path(l_uri);
+				gchar **parts = g_strsplit(endpoint_path, "/", -1);
+				int i=0;
+				while(parts[i] != NULL) {
+					if(parts[i+1] == NULL) {
+						/* Last part of the path, replace it */
+						g_free(parts[i]);
+						parts[i] = g_strdup(location);
+					}
+					i++;
+				}
+				char *resource_path = g_strjoinv("/", parts);
+				g_strfreev(parts);
+				uri = g_uri_build(SOUP_HTTP_URI_FLAGS,
+					g_uri_get_scheme(l_uri),
+					g_uri_get_userinfo(l_uri),
+					g_uri_get_host(l_uri),
+					g_uri_get_port(l_uri),
+					location, NULL, NULL);
+				g_free(resource_path);
+			}
+			s->resource_url = g_uri_to_string(uri);
+			g_uri_unref(l_uri);
+			g_uri_unref(uri);
+		}
+		WHIP_PREFIX(LOG_INFO, "Resource URL: %s\n", s->resource_url);
+	}
+	if(!full_sdp) {
+		/* Now that we know the resource url, prepare the timer to send trickle candidates:
+		 * since most candidates will be local, rather than sending an HTTP PATCH message as
+		 * soon as we're aware of it, we queue it, and we send a (grouped) message every ~100ms */
+		whip_add_timeout(s, 100, whip_send_candidates);
+	}
+
+	/* Process the SDP answer */
+	WHIP_PREFIX(LOG_INFO, "Received SDP answer (%zu bytes)\n", strlen(answer));
+	WHIP_LOG(LOG_VERB, "%s\n", answer);
+
+	/* Check if there are any candidates in the SDP: we'll need to fake trickles in case */
+	if(strstr(answer, "candidate") != NULL) {
+		int mlines = 0, i = 0;
+		gchar **lines = g_strsplit(answer, "\r\n", -1);
+		gchar *line = NULL;
+		while(lines[i] != NULL) {
+			line = lines[i];
+			if(strstr(line, "m=") == line) {
+				/* New m-line */
+				mlines++;
+				if(mlines > 1)	/* We only need candidates from the first one */
+					break;
+			} else if(mlines == 1 && strstr(line, "a=candidate") != NULL) {
+				/* Found a candidate, fake a trickle */
+				line += 2;
+				WHIP_LOG(LOG_VERB, "  -- Found candidate: %s\n", line);
+				g_signal_emit_by_name(s->pc, "add-ice-candidate", 0, line);
+			}
+			i++;
+		}
+		g_clear_pointer(&lines, g_strfreev);
+	}
+	/* Convert the SDP to something webrtcbin can digest */
+	GstSDPMessage *sdp = NULL;
+	int ret = gst_sdp_message_new(&sdp);
+	if(ret != GST_SDP_OK) {
+		/* Something went wrong */
+		WHIP_LOG(LOG_ERR, "Error initializing SDP object (%d)\n", ret);
+		g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+		g_free(answer);
+		whip_disconnect(s, "SDP error");
+		return;
+	}
+	ret = gst_sdp_message_parse_buffer((guint8 *)answer, strlen(answer), sdp);
+	g_object_unref(session.msg);
+	g_object_unref(session.http_conn);
+	g_free(answer);
+	if(ret != GST_SDP_OK) {
+		/* Something went wrong */
+		gst_sdp_message_free(sdp);
+		WHIP_LOG(LOG_ERR, "Error parsing SDP buffer (%d)\n", ret);
+		whip_disconnect(s, "SDP error");
+		return;
+	}
+	GstWebRTCSessionDescription *gst_sdp = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+
+	/* Set remote description on our pipeline */
+	WHIP_PREFIX(LOG_INFO, "Setting remote description\n");
+	GstPromise *promise = gst_promise_new();
+	g_signal_emit_by_name(s->pc, "set-remote-description", gst_sdp, promise);
+	gst_promise_interrupt(promise);
+	gst_promise_unref(promise);
+	gst_webrtc_session_description_free(gst_sdp);
+}
+
+/* Helper method to disconnect from the WHIP endpoint (or fail over) */
+static void whip_disconnect(whip_session *s, const char *reason) {
+	if(!g_atomic_int_get(&s->stopping) && s->config.backup_urls != NULL && s->valves != NULL) {
+		/* Our PeerConnection failed, try failing over (only once, as
+		 * the dead PeerConnection may keep on notifying failures) */
+		if(!g_atomic_int_compare_and_exchange(&s->primary_failed, 0, 1))
+			return;
+		if(whip_failover(s, reason))
+			return;
+	}
+	whip_teardown(s, reason);
+}
+
+/* Helper method to tear down the session */
+static void whip_teardown(whip_session *s, const char *reason) {
+	if(!g_atomic_int_compare_and_exchange(&s->disconnected, 0, 1))
+		return;
+	WHIP_PREFIX(LOG_INFO, "Disconnecting from server (%s)\n", reason);
+	/* No point in trickling anymore */
+	g_cancellable_cancel(s->trickle_cancellable);
+	if(s->backup != NULL) {
+		/* Tear down the session to the backup endpoint first */
+		whip_session *backup = s->backup;
+		s->backup = NULL;
+		s->retired = g_list_prepend(s->retired, backup);
+		whip_session_stop(backup, reason);
+	}
+	if(g_atomic_int_get(&s->primary_failed)) {
+		/* We failed over, the endpoint is most likely unreachable, so we
+		 * don't block on a DELETE and let the server time the resource out */
+		WHIP_LOG(LOG_WARN, "Not sending DELETE to failed endpoint\n");
+	} else if(s->resource_url != NULL && g_atomic_int_get(&s->shutting_down)) {
+		if(s->deadline_expired) {
+			WHIP_LOG(LOG_WARN, "Not sending DELETE, teardown deadline expired\n");
+		} else {
+			/* Send the DELETE asynchronously: we're done when we get a
+			 * response, or when the deadline expires, whatever comes first */
+			g_main_context_invoke(s->context, whip_teardown_delete, s);
+			return;
+		}
+	} else if(s->resource_url != NULL) {
+		/* Don't block forever if the server is unreachable */
+		if(s->config.teardown_timeout > 0) {
+			s->http_timeout = (s->config.teardown_timeout + 999) / 1000;
+			if(s->http != NULL)
+				soup_session_set_timeout(s->http, s->http_timeout);
+		}
+		/* Create an HTTP connection */
+		whip_http_session session = { 0 };
+		guint status = whip_http_send(s, &session, "DELETE", s->resource_url, NULL, NULL, NULL);
+		if(status != 200) {
+			WHIP_LOG(LOG_WARN, " [%u] %s\n", status, status ? soup_message_get_reason_phrase(session.msg) : "HTTP error");
+		}
+		if(session.msg != NULL)
+			g_object_unref(session.msg);
+		g_object_unref(session.http_conn);
+	}
+
+	/* Done */
+	whip_teardown_finish(s, reason);
+}
+
+/* Helper method to notify the application the session is gone (only once) */
+static void whip_teardown_finish(whip_session *s, const char *reason) {
+	if(!g_atomic_int_compare_and_exchange(&s->finished, 0, 1))
+		return;
+	whip_set_state(s, WHIP_SESSION_DISCONNECTED);
+	if(s->callbacks.disconnected != NULL)
+		s->callbacks.disconnected(s, reason, s->user_data);
+}
+
+/* Callback invoked when the asynchronous DELETE completes */
+static void whip_teardown_done(GObject *source, GAsyncResult *result, gpointer user_data) {
+	SoupSession *http_conn = SOUP_SESSION(source);
+	SoupMessage *msg = soup_session_get_async_result_message(http_conn, result);
+	GError *error = NULL;
+	GInputStream *stream = soup_session_send_finish(http_conn, result, &error);
+	if(stream != NULL)
+		g_object_unref(stream);
+	if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* The session is going away, don't touch it */
+		g_error_free(error);
+		return;
+	}
+	whip_session *s = (whip_session *)user_data;
+	guint status = error ? 0 : soup_message_get_status(msg);
+	if(s->teardown_cached && !s->deadline_expired && (status == 0 || status == 404 || status == 410)) {
+		/* The cached redirect didn't work, forget about it and try the original url */
+		char *requested = g_uri_to_string(soup_message_get_uri(msg));
+		WHIP_LOG(LOG_WARN, "Cached redirect to %s failed, trying %s\n", requested, s->resource_url);
+		g_free(requested);
+		g_clear_error(&error);
+		whip_redirect_forget(s, s->resource_url);
+		s->teardown_cached = FALSE;
+		if(whip_teardown_send(s, s->resource_url))
+			return;
+		whip_teardown_finish(s, s->shutdown_reason);
+		return;
+	}
+	if((status == 301 || status == 307) && !s->deadline_expired) {
+		/* Redirected: remember where, and send the DELETE again */
+		const char *location = soup_message_headers_get_one(soup_message_get_response_headers(msg), "location");
+		char *requested = g_uri_to_string(soup_message_get_uri(msg));
+		char *target = location ? whip_redirect_resolve(requested, location) : NULL;
+		if(target != NULL && s->teardown_redirects < WHIP_REDIRECTS_MAX) {
+			s->teardown_redirects++;
+			WHIP_LOG(LOG_INFO, "  -- Redirected to %s\n", target);
+			whip_redirect_store(s, requested, target, status == 301);
+			gboolean sent = whip_teardown_send(s, target);
+			g_free(target);
+			g_free(requested);
+			if(sent)
+				return;
+			whip_teardown_finish(s, s->shutdown_reason);
+			return;
+		}
+		g_free(target);
+		g_free(requested);
+	}
+	if(error != NULL) {
+		WHIP_LOG(LOG_WARN, "Error sending DELETE: %s\n", error->message);
+		g_error_free(error);
+	} else {
+		whip_http_metrics(s, msg);
+		if(status != 200)
+			WHIP_LOG(LOG_WARN, " [%u] %s\n", status, soup_message_get_reason_phrase(msg));
+	}
+	whip_teardown_finish(s, s->shutdown_reason);
+}
+
+/* Helper method to send a DELETE to a url asynchronously: returns FALSE
+ * if it couldn't be sent (e.g., because the deadline expired already) */
+static gboolean whip_teardown_send(whip_session *s, const char *url) {
+	if(s->deadline_expired)
+		return FALSE;
+	SoupMessage *msg = whip_http_message(s, "DELETE", url, NULL, NULL);
+	if(msg == NULL)
+		return FALSE;
+	if(s->teardown_http == NULL)
+		s->teardown_http = s->http ? g_object_ref(s->http) : whip_http_session_new(s);
+	if(s->teardown_cancellable == NULL)
+		s->teardown_cancellable = g_cancellable_new();
+	soup_session_send_async(s->teardown_http, msg, G_PRIORITY_DEFAULT,
+		s->teardown_cancellable, whip_teardown_done, s);
+	g_object_unref(msg);
+	return TRUE;
+}
+
+/* Helper method to send the DELETE asynchronously, from the session context:
+ * as the synchronous version, it uses (and follows) redirects if needed */
+static gboolean whip_teardown_delete(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	char *url = whip_redirect_lookup(s, s->resource_url);
+	s->teardown_cached = (url != NULL);
+	if(!whip_teardown_send(s, url ? url : s->resource_url))
+		whip_teardown_finish(s, s->shutdown_reason);
+	g_free(url);
+	return G_SOURCE_REMOVE;
+}
+
+/* Timer callback invoked when the shutdown deadline expires */
+static gboolean whip_shutdown_deadline(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->finished))
+		return G_SOURCE_REMOVE;
+	WHIP_LOG(LOG_WARN, "Teardown deadline expired, not waiting any longer\n");
+	s->deadline_expired = TRUE;
+	if(!g_atomic_int_get(&s->disconnected))
+		whip_disconnect(s, s->shutdown_reason);
+	else
+		whip_teardown_finish(s, s->shutdown_reason);
+	return G_SOURCE_REMOVE;
+}
+
+/* Callback invoked when all the webrtcbin sink pads got the EOS */
+static gboolean whip_shutdown_flushed(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(!s->deadline_expired)
+		whip_disconnect(s, s->shutdown_reason);
+	return G_SOURCE_REMOVE;
+}
+
+/* Pad probe on webrtcbin sink pads, waiting for the EOS that follows the final frames */
+static GstPadProbeReturn whip_shutdown_eos_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+	if(event == NULL || GST_EVENT_TYPE(event) != GST_EVENT_EOS)
+		return GST_PAD_PROBE_OK;
+	if(g_atomic_int_dec_and_test(&s->eos_pending)) {
+		WHIP_LOG(LOG_VERB, "Encoders flushed\n");
+		g_main_context_invoke(s->context, whip_shutdown_flushed, s);
+	}
+	return GST_PAD_PROBE_REMOVE;
+}
+static gboolean whip_shutdown_watch_pad(GstElement *element, GstPad *pad, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(!gst_pad_is_linked(pad))
+		return TRUE;
+	g_atomic_int_inc(&s->eos_pending);
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, whip_shutdown_eos_probe, s, NULL);
+	return TRUE;
+}
+
+/* Helper method to start a non-blocking shutdown, from the session context:
+ * we first send an EOS, so that encoders flush their final frames, and then
+ * send the DELETE asynchronously, all bounded by the teardown timeout */
+static gboolean whip_shutdown_start(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	g_atomic_int_set(&s->stopping, 1);
+	if(g_atomic_int_get(&s->disconnected)) {
+		/* Nothing to tear down */
+		return G_SOURCE_REMOVE;
+	}
+	if(s->config.teardown_timeout > 0)
+		whip_add_timeout(s, s->config.teardown_timeout, whip_shutdown_deadline);
+	if(s->owned && s->pipeline != NULL && s->public_state == WHIP_SESSION_CONNECTED) {
+		/* We hold a reference of our own while adding the probes, so that
+		 * a pad getting the EOS already can't complete the count too early */
+		g_atomic_int_set(&s->eos_pending, 1);
+		gst_element_foreach_sink_pad(s->pc, whip_shutdown_watch_pad, s);
+		if(!g_atomic_int_dec_and_test(&s->eos_pending)) {
+			WHIP_PREFIX(LOG_INFO, "Sending EOS, to flush the encoders\n");
+			gst_element_send_event(s->pipeline, gst_event_new_eos());
+			return G_SOURCE_REMOVE;
+		}
+	}
+	whip_disconnect(s, s->shutdown_reason);
+	return G_SOURCE_REMOVE;
+}
+
+/* Static helper to autoaccept certificates */
+static gboolean whip_http_accept_certs(SoupMessage *msg, GTlsCertificate *certificate,
+		GTlsCertificateFlags tls_errors, gpointer user_data) {
+    return TRUE;
+}
+
+/* Helper method to create a libsoup HTTP session */
+static SoupSession *whip_http_session_new(whip_session *s) {
+	SoupSession *http_conn = soup_session_new();
+	if(s->http_timeout > 0)
+		soup_session_set_timeout(http_conn, s->http_timeout);
+	if(s->soup_debug_level != SOUP_LOGGER_LOG_NONE) {
+		SoupLogger *logger = soup_logger_new(s->soup_debug_level);
+		soup_session_add_feature(http_conn, SOUP_SESSION_FEATURE(logger));
+		g_object_unref(logger);
+	}
+	return http_conn;
+}
+
+/* Helper method to create a libsoup HTTP message, with the headers we need */
+static SoupMessage *whip_http_message(whip_session *s, const char *method,
+		const char *url, const char *payload, const char *content_type) {
+	SoupMessage *msg = soup_message_new(method, url);
+	if(msg == NULL)
+		return NULL;
+	soup_message_set_flags(msg, SOUP_MESSAGE_NO_REDIRECT | SOUP_MESSAGE_COLLECT_METRICS);
+	if(s->config.force_http1)
+		soup_message_set_force_http1(msg, TRUE);
+	g_signal_connect(msg, "accept-certificate", G_CALLBACK(whip_http_accept_certs), NULL);
+	if(payload != NULL && content_type != NULL) {
+		GBytes *pb = g_bytes_new(payload, strlen(payload));
+		soup_message_set_request_body_from_bytes(msg, content_type, pb);
+		g_bytes_unref(pb);
+	}
+	if(s->config.token != NULL) {
+		/* Add an authorization header too */
+		char auth[1024];
+		g_snprintf(auth, sizeof(auth), "Bearer %s", s->config.token);
+		soup_message_headers_append(soup_message_get_request_headers(msg), "Authorization", auth);
+	}
+	if(s->latest_etag != NULL) {
+		/* Add an If-Match header too with the available ETag */
+		soup_message_headers_append(soup_message_get_request_headers(msg), "If-Match", s->latest_etag);
+	}
+	return msg;
+}
+
+/* Helper method to send HTTP messages */
+static guint whip_http_send(whip_session *s, whip_http_session *session, char *method,
+		char *url, char *payload, char *content_type, GBytes **bytes) {
+	if(session == NULL || method == NULL || url == NULL) {
+		WHIP_LOG(LOG_ERR, "Invalid arguments...\n");
+		return 0;
+	}
+	if(session->redirect_url == NULL && !session->skip_redirect_cache) {
+		/* Check if we know already where this request would be redirected to */
+		session->redirect_url = whip_redirect_lookup(s, url);
+		session->cached_redirect = (session->redirect_url != NULL);
+		if(session->cached_redirect)
+			WHIP_LOG(LOG_VERB, "  -- Using cached redirect to %s\n", session->redirect_url);
+	}
+	/* Create an HTTP connection (or reuse the one we have) */
+	session->http_conn = s->http ? g_object_ref(s->http) : whip_http_session_new(s);
+	session->msg = whip_http_message(s, method, session->redirect_url ? session->redirect_url : url,
+		payload, content_type);
+	if(session->msg == NULL) {
+		WHIP_LOG(LOG_ERR, "Invalid url '%s'...\n", session->redirect_url ? session->redirect_url : url);
+		return 0;
+	}
+	/* Send the message synchronously */
+	GBytes *rb = NULL;
+	GError *error = NULL;
+	if(bytes != NULL) {
+		rb = soup_session_send_and_read(session->http_conn, session->msg, NULL, &error);
+	} else {
+		GInputStream *stream = soup_session_send(session->http_conn, session->msg, NULL, &error);
+		if(stream != NULL)
+			g_object_unref(stream);
+	}
+	SoupStatus status = error ? 0 : soup_message_get_status(session->msg);
+	if(error == NULL)
+		whip_http_metrics(s, session->msg);
+	if(session->cached_redirect && (status == 0 || status == 404 || status == 410)) {
+		/* The cached redirect didn't work, forget about it and try the original url */
+		WHIP_LOG(LOG_WARN, "Cached redirect to %s failed, trying %s\n", session->redirect_url, url);
+		whip_redirect_forget(s, url);
+		g_clear_error(&error);
+		if(rb != NULL)
+			g_bytes_unref(rb);
+		g_object_unref(session->msg);
+		g_object_unref(session->http_conn);
+		g_free(session->redirect_url);
+		session->redirect_url = NULL;
+		session->cached_redirect = FALSE;
+		session->skip_redirect_cache = TRUE;
+		return whip_http_send(s, session, method, url, payload, content_type, bytes);
+	}
+	if(error != NULL) {
+		WHIP_LOG(LOG_ERR, "Error sending request: %s...\n", error->message);
+		g_error_free(error);
+		if(rb != NULL)
+			g_bytes_unref(rb);
+		return 0;
+	}
+	if(status == 301 || status == 307) {
+		/* Redirected? Let's try again */
+		session->redirects++;
+		if(session->redirects > WHIP_REDIRECTS_MAX) {
+			/* Redirected too many times, give up... */
+			WHIP_LOG(LOG_ERR, "Too many redirects, giving up...\n");
+			if(rb != NULL)
+				g_bytes_unref(rb);
+			return 0;
+		}
+		const char *location = soup_message_headers_get_one(soup_message_get_response_headers(session->msg), "location");
+		if(location == NULL) {
+			WHIP_LOG(LOG_ERR, "Redirect without a Location header, giving up...\n");
+			if(rb != NULL)
+				g_bytes_unref(rb);
+			return 0;
+		}
+		char *requested = session->redirect_url;
+		session->redirect_url = whip_redirect_resolve(requested ? requested : url, location);
+		if(session->redirect_url == NULL) {
+			WHIP_LOG(LOG_ERR, "Invalid Location header in redirect (%s), giving up...\n", location);
+			g_free(requested);
+			if(rb != NULL)
+				g_bytes_unref(rb);
+			return 0;
+		}
+		/* Remember the redirect, so that we can skip the hop next time */
+		whip_redirect_store(s, requested ? requested : url, session->redirect_url, status == 301);
+		g_free(requested);
+		WHIP_LOG(LOG_INFO, "  -- Redirected to %s\n", session->redirect_url);
+		g_object_unref(session->msg);
+		g_object_unref(session->http_conn);
+		if(rb != NULL)
+			g_bytes_unref(rb);
+		return whip_http_send(s, session, method, url, payload, content_type, bytes);
+	}
+	/* If we got here, we're done */
+	g_free(session->redirect_url);
+	session->redirect_url = NULL;
+	if(rb != NULL)
+		*bytes = rb;
+	return status;
+}
+
+/* Helper method to compute how long a phase took from libsoup metrics */
+static guint64 whip_http_span(guint64 start, guint64 end) {
+	return (start > 0 && end >= start) ? end - start : 0;
+}
+
+/* Helper method to log and keep track of the timing of an HTTP request */
+static void whip_http_metrics(whip_session *s, SoupMessage *msg) {
+	SoupMessageMetrics *metrics = msg ? soup_message_get_metrics(msg) : NULL;
+	if(metrics == NULL)
+		return;
+	/* DNS, connect and TLS are all zero when a connection is reused, and
+	 * the connect phase includes the TLS handshake, which we split */
+	guint64 tls_start = soup_message_metrics_get_tls_start(metrics);
+	guint64 connect_end = soup_message_metrics_get_connect_end(metrics);
+	guint64 response_start = soup_message_metrics_get_response_start(metrics);
+	guint64 response_end = soup_message_metrics_get_response_end(metrics);
+	if(response_end == 0) {
+		/* We didn't read the body */
+		response_end = response_start;
+	}
+	guint64 dns = whip_http_span(soup_message_metrics_get_dns_start(metrics),
+		soup_message_metrics_get_dns_end(metrics));
+	guint64 connect = whip_http_span(soup_message_metrics_get_connect_start(metrics),
+		tls_start ? tls_start : connect_end);
+	guint64 tls = whip_http_span(tls_start, connect_end);
+	guint64 wait = whip_http_span(soup_message_metrics_get_request_start(metrics), response_start);
+	guint64 transfer = whip_http_span(response_start, response_end);
+	guint64 total = whip_http_span(soup_message_metrics_get_fetch_start(metrics), response_end);
+	const char *method = soup_message_get_method(msg);
+	char *url = g_uri_to_string(soup_message_get_uri(msg));
+	WHIP_LOG(s->config.http_timing_log_level, " [http] %s %s: dns %.2fms, connect %.2fms, tls %.2fms, "
+		"wait %.2fms, transfer %.2fms (total %.2fms)\n", method, url,
+		(double)dns/1000, (double)connect/1000, (double)tls/1000,
+		(double)wait/1000, (double)transfer/1000, (double)total/1000);
+	g_free(url);
+	g_mutex_lock(&s->http_mutex);
+	whip_http_timing *timing = g_hash_table_lookup(s->http_timings, method);
+	if(timing == NULL) {
+		timing = g_malloc0(sizeof(whip_http_timing));
+		g_hash_table_insert(s->http_timings, g_strdup(method), timing);
+	}
+	timing->requests++;
+	timing->dns += dns;
+	timing->connect += connect;
+	timing->tls += tls;
+	timing->wait += wait;
+	timing->transfer += transfer;
+	timing->total += total;
+	int b = 0;
+	while(b < WHIP_HTTP_BUCKETS-1 && total >= (guint64)whip_http_buckets[b] * 1000)
+		b++;
+	timing->histogram[b]++;
+	g_mutex_unlock(&s->http_mutex);
+}
+
+/* Helper method to resolve the Location header of a redirect (which may be
+ * an absolute url, or relative to the url we sent the request to) */
+static char *whip_redirect_resolve(const char *requested, const char *location) {
+	return g_uri_resolve_relative(requested, location, SOUP_HTTP_URI_FLAGS, NULL);
+}
+
+/* Helper method to find where a url is redirected to, if we know already:
+ * redirects may be chained, so we follow them until we can (max 10 hops) */
+static char *whip_redirect_lookup(whip_session *s, const char *url) {
+	const char *target = NULL, *next = NULL;
+	int hops = 0;
+	g_mutex_lock(&whip_redirects_mutex);
+	while(hops < WHIP_REDIRECTS_MAX) {
+		const char *current = target ? target : url;
+		next = whip_permanent_redirects ? g_hash_table_lookup(whip_permanent_redirects, current) : NULL;
+		if(next == NULL && s->redirects != NULL)
+			next = g_hash_table_lookup(s->redirects, current);
+		if(next == NULL)
+			break;
+		target = next;
+		hops++;
+	}
+	char *redirect = g_strdup(target);
+	g_mutex_unlock(&whip_redirects_mutex);
+	return redirect;
+}
+
+/* Helper method to remember a redirect */
+static void whip_redirect_store(whip_session *s, const char *url, const char *target, gboolean permanent) {
+	g_mutex_lock(&whip_redirects_mutex);
+	if(permanent) {
+		if(whip_permanent_redirects == NULL)
+			whip_permanent_redirects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		g_hash_table_insert(whip_permanent_redirects, g_strdup(url), g_strdup(target));
+	} else if(s->redirects != NULL) {
+		g_hash_table_insert(s->redirects, g_strdup(url), g_strdup(target));
+	}
+	g_mutex_unlock(&whip_redirects_mutex);
+}
+
+/* Helper method to forget about the redirects for a url: we drop the whole
+ * chain, as any of the intermediate hops may be the one that's stale */
+static void whip_redirect_forget(whip_session *s, const char *url) {
+	char *current = g_strdup(url);
+	int hops = 0;
+	g_mutex_lock(&whip_redirects_mutex);
+	while(current != NULL && hops < WHIP_REDIRECTS_MAX) {
+		const char *next = whip_permanent_redirects ? g_hash_table_lookup(whip_permanent_redirects, current) : NULL;
+		if(next == NULL && s->redirects != NULL)
+			next = g_hash_table_lookup(s->redirects, current);
+		char *target = g_strdup(next);
+		if(whip_permanent_redirects != NULL)
+			g_hash_table_remove(whip_permanent_redirects, current);
+		if(s->redirects != NULL)
+			g_hash_table_remove(s->redirects, current);
+		g_free(current);
+		current = target;
+		hops++;
+	}
+	g_free(current);
+	g_mutex_unlock(&whip_redirects_mutex);
+}
+
+/* Helper method to parse SDP offers and extract stuff we need */
+static gboolean whip_parse_offer(whip_session *s, char *sdp_offer) {
+	gchar **parts = g_strsplit(sdp_offer, "\n", -1);
+	gboolean mline = FALSE, success = TRUE, done = FALSE;
+	if(parts) {
+		int index = 0;
+		char *line = NULL, *cr = NULL;
+		while(!done && success && (line = parts[index]) != NULL) {
+			cr = strchr(line, '\r');
+			if(cr != NULL)
+				*cr = '\0';
+			if(*line == '\0') {
+				if(cr != NULL)
+					*cr = '\r';
+				index++;
+				continue;
+			}
+			if(strlen(line) < 3) {
+				WHIP_LOG(LOG_ERR, "Invalid line (%zu bytes): %s", strlen(line), line);
+				success = FALSE;
+				break;
+			}
+			if(*(line+1) != '=') {
+				WHIP_LOG(LOG_ERR, "Invalid line (2nd char is not '='): %s", line);
+				success = FALSE;
+				break;
+			}
+			char c = *line;
+			if(!mline) {
+				/* Global stuff */
+				switch(c) {
+					case 'a': {
+						line += 2;
+						char *semicolon = strchr(line, ':');
+						if(semicolon != NULL && *(semicolon+1) != '\0') {
+							*semicolon = '\0';
+							if(!strcasecmp(line, "ice-ufrag")) {
+								g_free(s->ice_ufrag);
+								s->ice_ufrag = g_strdup(semicolon+1);
+							} else if(!strcasecmp(line, "ice-pwd")) {
+								g_free(s->ice_pwd);
+								s->ice_pwd = g_strdup(semicolon+1);
+							}
+							*semicolon = ':';
+						}
+						break;
+					}
+					case 'm': {
+						/* We found the first m-line, that we'll bundle on */
+						mline = TRUE;
+						char *space = strchr(line+2, ' ');
+						if(space != NULL) {
+							g_free(s->first_media);
+							s->first_media = g_strndup(line+2, space-(line+2));
+						}
+						break;
+					}
+					default: {
+						/* We ignore everything else, this is not a full parser */
+						break;
+					}
+				}
+			} else {
+				/* m-line stuff */
+				switch(c) {
+					case 'a': {
+						line += 2;
+						char *semicolon = strchr(line, ':');
+						if(semicolon != NULL && *(semicolon+1) != '\0') {
+							*semicolon = '\0';
+							if(!strcasecmp(line, "ice-ufrag")) {
+								g_free(s->ice_ufrag);
+								s->ice_ufrag = g_strdup(semicolon+1);
+							} else if(!strcasecmp(line, "ice-pwd")) {
+								g_free(s->ice_pwd);
+								s->ice_pwd = g_strdup(semicolon+1);
+							} else if(!strcasecmp(line, "mid")) {
+								g_free(s->first_mid);
+								s->first_mid = g_strdup(semicolon+1);
+							}
+							*semicolon = ':';
+						}
+						break;
+					}
+					case 'm': {
+						/* First m-line ended, we're done */
+						done = TRUE;
+						break;
+					}
+					default: {
+						/* We ignore everything else, this is not a full parser */
+						break;
+					}
+				}
+			}
+			if(cr != NULL)
+				*cr = '\r';
+			index++;
+		}
+		if(cr != NULL)
+			*cr = '\r';
+		g_strfreev(parts);
+	}
+	return success;
+}
+
+/* Helper method to parse a Link header, and in case set the STUN/TURN server */
+static void whip_process_link_header(whip_session *s, char *link) {
+	if(link == NULL)
+		return;
+	WHIP_PREFIX(LOG_INFO, "  -- %s\n", link);
+	if(strstr(link, "rel=\"ice-server\"") == NULL) {
+		WHIP_LOG(LOG_WARN, "Missing 'rel=\"ice-server\"' attribute, skipping...\n");
+		return;
+	}
+	gboolean brackets = FALSE;
+	if(*link == '<') {
+		link++;
+		brackets = TRUE;
+	}
+	if(strstr(link, "stun:") == link) {
+		/* STUN server */
+		if(s->auto_stun_server != NULL) {
+			WHIP_LOG(LOG_WARN, "Ignoring multiple STUN servers...\n");
+			return;
+		}
+		gchar **parts = g_strsplit(link, brackets ? ">; " : "; ", -1);
+		if(strstr(parts[0], "stun://") == parts[0]) {
+			/* Easy enough */
+			s->auto_stun_server = g_strdup(parts[0]);
+		} else {
+			char address[256];
+			g_snprintf(address, sizeof(address), "stun://%s", parts[0] + strlen("stun:"));
+			s->auto_stun_server = g_strdup(address);
+		}
+		g_clear_pointer(&parts, g_strfreev);
+		WHIP_PREFIX(LOG_INFO, "  -- -- %s\n", s->auto_stun_server);
+		return;
+	} else if(strstr(link, "turn:") == link || strstr(link, "turns:") == link) {
+		/* TURN server */
+		gboolean turns = (strstr(link, "turns:") == link);
+		char address[1024], host[256];
+		char *username = NULL, *credential = NULL;
+		host[0] = '\0';
+		GHashTable *list = soup_header_parse_semi_param_list(link);
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, list);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			if(strstr((char *)key, (turns ? "turns:" : "turn:")) == (char *)key) {
+				/* Host part */
+				if(strstr((char *)key, (turns ? "turns://" : "turn://")) == (char *)key) {
+					g_snprintf(host, sizeof(host), "%s", (char *)key + strlen(turns ? "turns://" : "turn://"));
+				} else {
+					g_snprintf(host, sizeof(host), "%s", (char *)key + strlen(turns ? "turns:" : "turn:"));
+				}
+				if(value != NULL) {
+					g_strlcat(host, "=", sizeof(host));
+					g_strlcat(host, (char *)value, sizeof(host));
+				}
+			} else if(!strcasecmp((char *)key, "username")) {
+				/* Username */
+				if(value != NULL) {
+					/* We need to escape this, as it will be part of the TURN uri */
+					g_free(username);
+					username = g_uri_escape_string((char *)value, NULL, FALSE);
+				}
+			} else if(!strcasecmp((char *)key, "credential")) {
+				/* Credential */
+				if(value != NULL) {
+					/* We need to escape this, as it will be part of the TURN uri */
+					g_free(credential);
+					credential = g_uri_escape_string((char *)value, NULL, FALSE);
+				}
+			}
+		}
+		soup_header_free_param_list(list);
+		if(username != NULL && credential != NULL && strlen(username) > 0 && strlen(credential) > 0) {
+			g_snprintf(address, sizeof(address), "%s://%s:%s@%s",
+				turns ? "turns" : "turn", username, credential, host);
+		} else {
+			g_snprintf(address, sizeof(address), "%s://%s",
+				turns ? "turns" : "turn", host);
+		}
+		if(brackets) {
+			char *b = strstr(address, ">");
+			if(b)
+				*b = '\0';
+		}
+		WHIP_PREFIX(LOG_INFO, "  -- -- %s\n", address);
+		g_free(username);
+		g_free(credential);
+		/* Add to the list of TURN servers */
+		if(s->auto_turn_server == NULL) {
+			s->auto_turn_server = g_malloc0(2*sizeof(gpointer));
+			s->auto_turn_server[0] = g_strdup(address);
+		} else {
+			int count = 0;
+			while(s->auto_turn_server[count] != NULL)
+				count++;
+			s->auto_turn_server = g_realloc(s->auto_turn_server, (count+2)*sizeof(gpointer));
+			s->auto_turn_server[count] = g_strdup(address);
+			s->auto_turn_server[count+1] = NULL;
+		}
+		return;
+	}
+	WHIP_LOG(LOG_WARN, "Unsupported protocol, skipping...\n");
+	return;
+}
+
+/* Helper method to iterate on all the elements in a bin */
+static void whip_foreach_element(GstBin *bin, GstIteratorForeachFunction func, gpointer user_data) {
+	if(bin == NULL || func == NULL)
+		return;
+	GstIterator *it = gst_bin_iterate_elements(bin);
+	while(gst_iterator_foreach(it, func, user_data) == GST_ITERATOR_RESYNC)
+		gst_iterator_resync(it);
+	gst_iterator_free(it);
+}
+
+/* Helper method to check the class of an element (e.g., "Encoder") */
+static gboolean whip_element_has_klass(GstElement *element, const char *klass) {
+	GstElementFactory *factory = gst_element_get_factory(element);
+	if(factory == NULL)
+		return FALSE;
+	const char *klasses = gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+	return (klasses != NULL && strstr(klasses, klass) != NULL);
+}
+
+/* Helper to get the current wallclock time as a 64-bit NTP time (in nanoseconds) */
+static guint64 whip_ntp_now(void) {
+	return (guint64)(g_get_real_time() + G_GINT64_CONSTANT(2208988800) * G_USEC_PER_SEC) * 1000;
+}
+
+/* Latency probe helpers */
+static whip_latency_stage *whip_latency_stage_new(whip_session *s, const char *prefix, const char *name) {
+	whip_latency_stage *stage = g_malloc0(sizeof(whip_latency_stage));
+	stage->name = g_strdup_printf("%s %s", prefix, name);
+	g_mutex_init(&stage->mutex);
+	g_ptr_array_add(s->latency_stages, stage);
+	return stage;
+}
+
+static void whip_latency_stage_free(whip_latency_stage *stage) {
+	if(stage == NULL)
+		return;
+	g_free(stage->name);
+	g_mutex_clear(&stage->mutex);
+	g_free(stage);
+}
+
+/* Pad probe on sources: we add the capture time as a reference timestamp meta */
+static GstPadProbeReturn whip_latency_capture_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(buffer == NULL)
+		return GST_PAD_PROBE_OK;
+	buffer = gst_buffer_make_writable(buffer);
+	gst_buffer_add_reference_timestamp_meta(buffer, ntp_caps, whip_ntp_now(), GST_CLOCK_TIME_NONE);
+	GST_PAD_PROBE_INFO_DATA(info) = buffer;
+	return GST_PAD_PROBE_OK;
+}
+
+/* Pad probe on encoders and webrtcbin: we check how long ago the frame was captured */
+static GstPadProbeReturn whip_latency_measure_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_latency_stage *stage = (whip_latency_stage *)user_data;
+	GstBuffer *buffer = NULL;
+	if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		if(list != NULL && gst_buffer_list_length(list) > 0)
+			buffer = gst_buffer_list_get(list, 0);
+	} else {
+		buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	}
+	if(buffer == NULL)
+		return GST_PAD_PROBE_OK;
+	GstReferenceTimestampMeta *meta = gst_buffer_get_reference_timestamp_meta(buffer, ntp_caps);
+	if(meta == NULL)
+		return GST_PAD_PROBE_OK;
+	guint64 now = whip_ntp_now();
+	if(now < meta->timestamp)
+		return GST_PAD_PROBE_OK;
+	guint64 delay = now - meta->timestamp;
+	g_mutex_lock(&stage->mutex);
+	if(meta->timestamp != stage->last_ts) {
+		/* Packetized frames may span multiple buffers, only count the first one */
+		stage->last_ts = meta->timestamp;
+		if(stage->count == 0 || delay < stage->min)
+			stage->min = delay;
+		if(delay > stage->max)
+			stage->max = delay;
+		stage->total += delay;
+		stage->count++;
+	}
+	g_mutex_unlock(&stage->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+#define WHIP_NTP64_URI	"urn:ietf:params:rtp-hdrext:ntp-64"
+
+/* Callback invoked for each element in the pipeline, to find the RTP header
+ * extension IDs that are already in use (by payloaders, or in RTP caps) */
+static void whip_latency_find_extmap(const GValue *item, gpointer user_data) {
+	guint32 *used = (guint32 *)user_data;
+	GstElement *element = g_value_get_object(item);
+	GstCaps *caps = NULL;
+	if(g_object_class_find_property(G_OBJECT_GET_CLASS(element), "caps"))
+		g_object_get(element, "caps", &caps, NULL);
+	if(caps != NULL) {
+		guint i = 0;
+		for(i = 0; i < gst_caps_get_size(caps); i++) {
+			GstStructure *structure = gst_caps_get_structure(caps, i);
+			int id = 0, n = 0;
+			for(n = 0; n < gst_structure_n_fields(structure); n++) {
+				const char *field = gst_structure_nth_field_name(structure, n);
+				if(g_str_has_prefix(field, "extmap-") && (id = atoi(field + strlen("extmap-"))) > 0 && id < 32)
+					*used |= (1u << id);
+			}
+		}
+		gst_caps_unref(caps);
+	}
+#if GST_CHECK_VERSION(1, 20, 0)
+	if(whip_element_has_klass(element, "Payloader") &&
+			g_object_class_find_property(G_OBJECT_GET_CLASS(element), "extensions")) {
+		GValue extensions = G_VALUE_INIT;
+		g_value_init(&extensions, GST_TYPE_ARRAY);
+		g_object_get_property(G_OBJECT(element), "extensions", &extensions);
+		guint i = 0;
+		for(i = 0; i < gst_value_array_get_size(&extensions); i++) {
+			GstRTPHeaderExtension *ext = g_value_get_object(gst_value_array_get_value(&extensions, i));
+			guint id = ext ? gst_rtp_header_extension_get_id(ext) : 0;
+			if(id > 0 && id < 32)
+				*used |= (1u << id);
+		}
+		g_value_unset(&extensions);
+	}
+#endif
+}
+
+/* Helper method to check the offer doesn't map our NTP-64 ID to something
+ * else (e.g., extensions webrtcbin adds on its own) */
+static void whip_latency_check_extmap(whip_session *s, GstSDPMessage *sdp) {
+	guint i = 0, j = 0;
+	for(i = 0; i < gst_sdp_message_medias_len(sdp); i++) {
+		const GstSDPMedia *media = gst_sdp_message_get_media(sdp, i);
+		for(j = 0; j < gst_sdp_media_attributes_len(media); j++) {
+			const GstSDPAttribute *attr = gst_sdp_media_get_attribute(media, j);
+			if(strcmp(attr->key, "extmap") || attr->value == NULL || atoi(attr->value) != s->latency_ext_id)
+				continue;
+			if(strstr(attr->value, WHIP_NTP64_URI) == NULL) {
+				WHIP_LOG(LOG_WARN, "RTP extension ID %d is used for NTP-64 and in 'a=extmap:%s', receivers may get confused\n",
+					s->latency_ext_id, attr->value);
+			}
+		}
+	}
+}
+
+/* Callback invoked for each element in the pipeline, to add the latency probes */
+static void whip_latency_setup_element(const GValue *item, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstElement *element = g_value_get_object(item);
+	if(element == s->pc)
+		return;
+	char *name = gst_element_get_name(element);
+	GstPad *srcpad = gst_element_get_static_pad(element, "src");
+	if(GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SOURCE) && srcpad != NULL) {
+		/* Capture source, stamp the capture time */
+		WHIP_PREFIX(LOG_INFO, "  -- Stamping capture time on '%s'\n", name);
+		gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+			whip_latency_capture_probe, NULL, NULL);
+	} else if(whip_element_has_klass(element, "Encoder") && srcpad != NULL) {
+		/* Encoder, measure capture-to-encode latency */
+		whip_latency_stage *stage = whip_latency_stage_new(s, "capture-to-encode", name);
+		gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+			whip_latency_measure_probe, stage, NULL);
+	} else if(whip_element_has_klass(element, "Payloader")) {
+#if GST_CHECK_VERSION(1, 20, 0)
+		/* RTP payloader, add the NTP-64 header extension so that receivers
+		 * can compute the glass-to-glass latency on their end too */
+		GstRTPHeaderExtension *ext = (s->latency_ext_id > 0 ?
+			gst_rtp_header_extension_create_from_uri(WHIP_NTP64_URI) : NULL);
+		if(ext == NULL && s->latency_ext_id > 0) {
+			WHIP_LOG(LOG_WARN, "NTP-64 RTP header extension not available, receivers won't see capture times\n");
+		} else if(ext != NULL) {
+			gst_rtp_header_extension_set_id(ext, s->latency_ext_id);
+			g_signal_emit_by_name(element, "add-extension", ext);
+			gst_object_unref(ext);
+			WHIP_PREFIX(LOG_INFO, "  -- Added NTP-64 RTP header extension to '%s' (ID %d)\n", name, s->latency_ext_id);
+		}
+#else
+		WHIP_LOG(LOG_WARN, "RTP header extensions need GStreamer >= 1.20, receivers won't see capture times\n");
+#endif
+	}
+	if(srcpad != NULL)
+		gst_object_unref(srcpad);
+	g_free(name);
+}
+
+/* Helper method to add all the probes we need to measure latency */
+static void whip_latency_setup(whip_session *s) {
+	WHIP_PREFIX(LOG_INFO, "Setting up the latency probes\n");
+	if(ntp_caps == NULL)
+		ntp_caps = gst_caps_new_empty_simple("timestamp/x-ntp");
+	if(s->latency_stages == NULL)
+		s->latency_stages = g_ptr_array_new_with_free_func((GDestroyNotify)whip_latency_stage_free);
+	/* Pick an RTP extension ID for NTP-64 that's not used already (one-byte
+	 * header extensions can use 1-14) */
+	guint32 used = 0;
+	whip_foreach_element(s->bin, (GstIteratorForeachFunction)whip_latency_find_extmap, &used);
+	int id = 0;
+	for(id = 1; id <= 14 && (used & (1u << id)); id++);
+	if(id > 14) {
+		WHIP_LOG(LOG_WARN, "No free RTP extension ID, receivers won't see capture times\n");
+		id = 0;
+	}
+	s->latency_ext_id = id;
+	/* Sources, encoders and payloaders are in the partial pipelines */
+	whip_foreach_element(s->bin, (GstIteratorForeachFunction)whip_latency_setup_element, s);
+	/* Measure when RTP packets are handed to webrtcbin as well */
+	GstIterator *it = gst_element_iterate_sink_pads(s->pc);
+	GValue item = G_VALUE_INIT;
+	gboolean done = FALSE;
+	while(!done) {
+		switch(gst_iterator_next(it, &item)) {
+			case GST_ITERATOR_OK: {
+				GstPad *sinkpad = g_value_get_object(&item);
+				char *name = gst_pad_get_name(sinkpad);
+				whip_latency_stage *stage = whip_latency_stage_new(s, "capture-to-send", name);
+				gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+					whip_latency_measure_probe, stage, NULL);
+				g_free(name);
+				g_value_reset(&item);
+				break;
+			}
+			case GST_ITERATOR_RESYNC:
+				gst_iterator_resync(it);
+				break;
+			default:
+				done = TRUE;
+				break;
+		}
+	}
+	g_value_unset(&item);
+	gst_iterator_free(it);
+	/* Print a report periodically */
+	whip_add_timeout(s, s->config.report_interval * 1000, whip_latency_report);
+}
+
+/* Timer callback to print a latency report */
+static gboolean whip_latency_report(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(s->latency_stages == NULL || g_atomic_int_get(&s->disconnected))
+		return FALSE;
+	WHIP_PREFIX(LOG_INFO, "Latency report (last %ds):\n", s->config.report_interval);
+	guint i = 0;
+	for(i = 0; i < s->latency_stages->len; i++) {
+		whip_latency_stage *stage = g_ptr_array_index(s->latency_stages, i);
+		g_mutex_lock(&stage->mutex);
+		if(stage->count == 0) {
+			WHIP_PREFIX(LOG_INFO, "  -- %s: no capture timestamps\n", stage->name);
+		} else {
+			WHIP_PREFIX(LOG_INFO, "  -- %s: min %.2fms, avg %.2fms, max %.2fms (%"PRIu64" frames)\n",
+				stage->name, (double)stage->min / GST_MSECOND,
+				(double)stage->total / stage->count / GST_MSECOND,
+				(double)stage->max / GST_MSECOND, stage->count);
+		}
+		stage->count = 0;
+		stage->total = 0;
+		stage->min = 0;
+		stage->max = 0;
+		g_mutex_unlock(&stage->mutex);
+	}
+	return TRUE;
+}
+
+/* Profiling helpers */
+static void whip_profile_element_free(whip_profile_element *pe) {
+	if(pe == NULL)
+		return;
+	gst_object_unref(pe->element);
+	g_free(pe->name);
+	g_mutex_clear(&pe->mutex);
+	g_free(pe);
+}
+
+/* Pad probe on sink pads: we keep track of when buffers come in */
+static GstPadProbeReturn whip_profile_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_profile_element *pe = (whip_profile_element *)user_data;
+	g_mutex_lock(&pe->mutex);
+	pe->last_in = g_get_monotonic_time();
+	g_mutex_unlock(&pe->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Pad probe on src pads: we compute the processing time and the rates */
+static GstPadProbeReturn whip_profile_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_profile_element *pe = (whip_profile_element *)user_data;
+	guint buffers = 0;
+	gsize bytes = 0;
+	if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		buffers = gst_buffer_list_length(list);
+		bytes = gst_buffer_list_calculate_size(list);
+	} else {
+		buffers = 1;
+		bytes = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+	}
+	gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&pe->mutex);
+	if(!pe->queue && pe->last_in > 0) {
+		/* Time between the latest buffer coming in and this one going out */
+		pe->proctime += (now - pe->last_in);
+		pe->samples++;
+		pe->last_in = 0;
+	}
+	pe->buffers += buffers;
+	pe->bytes += bytes;
+	g_mutex_unlock(&pe->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Callback invoked for each element in the pipeline, to add the profiling probes */
+static void whip_profile_setup_element(const GValue *item, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstElement *element = g_value_get_object(item);
+	if(element == s->pc)
+		return;
+	GstPad *srcpad = gst_element_get_static_pad(element, "src");
+	if(srcpad == NULL) {
+		/* Nothing we can measure here */
+		return;
+	}
+	whip_profile_element *pe = g_malloc0(sizeof(whip_profile_element));
+	pe->element = gst_object_ref(element);
+	pe->name = gst_element_get_name(element);
+	GstElementFactory *factory = gst_element_get_factory(element);
+	pe->queue = (factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "queue"));
+	g_mutex_init(&pe->mutex);
+	g_ptr_array_add(s->profile_elements, pe);
+	GstPad *sinkpad = gst_element_get_static_pad(element, "sink");
+	if(sinkpad != NULL) {
+		gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+			whip_profile_sink_probe, pe, NULL);
+		gst_object_unref(sinkpad);
+	}
+	gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+		whip_profile_src_probe, pe, NULL);
+	gst_object_unref(srcpad);
+}
+
+/* Helper method to add all the probes we need to profile the pipeline */
+static void whip_profile_setup(whip_session *s) {
+	WHIP_PREFIX(LOG_INFO, "Setting up the profiling probes\n");
+	if(s->profile_elements == NULL)
+		s->profile_elements = g_ptr_array_new_with_free_func((GDestroyNotify)whip_profile_element_free);
+	whip_foreach_element(s->bin, (GstIteratorForeachFunction)whip_profile_setup_element, s);
+	whip_add_timeout(s, s->config.report_interval * 1000, whip_profile_report);
+}
+
+/* Helper to sort profiled elements by average processing time */
+static gint whip_profile_compare(gconstpointer a, gconstpointer b) {
+	const whip_profile_element *pa = *((whip_profile_element **)a);
+	const whip_profile_element *pb = *((whip_profile_element **)b);
+	if(pa->avg == pb->avg)
+		return 0;
+	return (pa->avg > pb->avg) ? -1 : 1;
+}
+
+/* Timer callback to print a profiling report */
+static gboolean whip_profile_report(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	int report_interval = s->config.report_interval;
+	if(s->profile_elements == NULL || g_atomic_int_get(&s->disconnected))
+		return FALSE;
+	/* Take a snapshot of all elements, and sort them by processing time */
+	GPtrArray *sorted = g_ptr_array_sized_new(s->profile_elements->len);
+	guint i = 0;
+	for(i = 0; i < s->profile_elements->len; i++) {
+		whip_profile_element *pe = g_ptr_array_index(s->profile_elements, i);
+		g_mutex_lock(&pe->mutex);
+		pe->avg = pe->samples ? (pe->proctime / pe->samples) : 0;
+		g_mutex_unlock(&pe->mutex);
+		g_ptr_array_add(sorted, pe);
+	}
+	g_ptr_array_sort(sorted, whip_profile_compare);
+	WHIP_PREFIX(LOG_INFO, "Profiling report (last %ds, top %d by processing time):\n",
+		report_interval, s->config.profile_top);
+	int shown = 0;
+	for(i = 0; i < sorted->len; i++) {
+		whip_profile_element *pe = g_ptr_array_index(sorted, i);
+		g_mutex_lock(&pe->mutex);
+		if(pe->queue) {
+			/* Print the fill level of the queue */
+			guint level_buffers = 0, max_buffers = 0;
+			guint64 level_time = 0;
+			g_object_get(pe->element, "current-level-buffers", &level_buffers,
+				"current-level-time", &level_time, "max-size-buffers", &max_buffers, NULL);
+			WHIP_PREFIX(LOG_INFO, "  -- [queue] %s: %u/%u buffers (%.2fms), %.1f buffers/s\n",
+				pe->name, level_buffers, max_buffers, (double)level_time / GST_MSECOND,
+				(double)pe->buffers / report_interval);
+		} else if(shown < s->config.profile_top) {
+			WHIP_PREFIX(LOG_INFO, "  -- %s: avg %.3fms per buffer, %.1f buffers/s, %.1f kbps\n",
+				pe->name, (double)pe->avg / 1000,
+				(double)pe->buffers / report_interval,
+				(double)pe->bytes * 8 / 1000 / report_interval);
+			shown++;
+		}
+		pe->samples = 0;
+		pe->proctime = 0;
+		pe->buffers = 0;
+		pe->bytes = 0;
+		g_mutex_unlock(&pe->mutex);
+	}
+	g_ptr_array_free(sorted, TRUE);
+	return TRUE;
+}
+
+/* Helper method to parse a list of CPUs (e.g., 0-3,6) into a CPU set */
+static int whip_parse_cpu_list(const char *list, cpu_set_t *set) {
+	CPU_ZERO(set);
+	if(list == NULL)
+		return 0;
+	/* CPUs must exist on this host (IDs are not necessarily contiguous from
+	 * 0, e.g., in a cpuset) and be usable by this process: any invalid range
+	 * invalidates the whole list */
+	long configured = sysconf(_SC_NPROCESSORS_CONF);
+	guint64 max = MIN(configured > 0 ? (guint64)configured : 1, CPU_SETSIZE) - 1;
+	cpu_set_t allowed;
+	gboolean check_allowed = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+	gboolean valid = TRUE;
+	int i = 0;
+	gchar **ranges = g_strsplit(list, ",", -1);
+	while(valid && ranges[i] != NULL) {
+		char *range = g_strstrip(ranges[i]);
+		gchar **bounds = g_strsplit(range, "-", 2);
+		guint64 first = 0, last = 0;
+		GError *error = NULL;
+		if(!g_ascii_string_to_unsigned(g_strstrip(bounds[0]), 10, 0, max, &first, &error) ||
+				(bounds[1] != NULL && !g_ascii_string_to_unsigned(g_strstrip(bounds[1]), 10, 0, max, &last, &error))) {
+			WHIP_LOG(LOG_WARN, "Invalid CPU range '%s' (%s)\n", range, error->message);
+			g_error_free(error);
+			valid = FALSE;
+		} else {
+			if(bounds[1] == NULL)
+				last = first;
+			if(last < first) {
+				WHIP_LOG(LOG_WARN, "Invalid CPU range '%s'\n", range);
+				valid = FALSE;
+			}
+			guint64 cpu = 0;
+			for(cpu = first; valid && cpu <= last; cpu++) {
+				if(check_allowed && !CPU_ISSET(cpu, &allowed)) {
+					WHIP_LOG(LOG_WARN, "CPU %"G_GUINT64_FORMAT" not available to this process\n", cpu);
+					valid = FALSE;
+				} else {
+					CPU_SET(cpu, set);
+				}
+			}
+		}
+		g_strfreev(bounds);
+		i++;
+	}
+	g_strfreev(ranges);
+	if(!valid)
+		CPU_ZERO(set);
+	return CPU_COUNT(set);
+}
+
+/* Helper method to return how many threads an encoder should use at most, when
+ * not specified: 4, or 2 when aiming at low CPU usage */
+static int whip_encoder_max_threads(whip_session *s) {
+	if(s->config.encoder_profile != NULL && !strcasecmp(s->config.encoder_profile, "low-cpu"))
+		return 2;
+	return 4;
+}
+
+/* Callback invoked for each element in the pipeline, to size encoder threads */
+static void whip_encoder_set_threads(const GValue *item, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstElement *element = g_value_get_object(item);
+	if(!whip_element_has_klass(element, "Encoder"))
+		return;
+	const char *property = NULL;
+	if(g_object_class_find_property(G_OBJECT_GET_CLASS(element), "threads"))
+		property = "threads";
+	else if(g_object_class_find_property(G_OBJECT_GET_CLASS(element), "multi-thread"))
+		property = "multi-thread";
+	if(property == NULL)
+		return;
+	int threads = s->config.encoder_threads;
+	if(threads <= 0)
+		threads = MIN(s->encode_cpu_count, whip_encoder_max_threads(s));
+	char value[16];
+	g_snprintf(value, sizeof(value), "%d", threads);
+	gst_util_set_object_arg(G_OBJECT(element), property, value);
+	char *name = gst_element_get_name(element);
+	WHIP_PREFIX(LOG_INFO, "  -- Encoder '%s' using %d threads\n", name, threads);
+	g_free(name);
+}
+
+/* Helper method to check if an element is (or is in) a webrtcbin (e.g., ours, or the backup one) */
+static gboolean whip_element_in_webrtcbin(GstElement *element) {
+	GstObject *object = gst_object_ref(GST_OBJECT(element)), *parent = NULL;
+	while(object != NULL) {
+		if(GST_IS_ELEMENT(object)) {
+			GstElementFactory *factory = gst_element_get_factory(GST_ELEMENT(object));
+			if(factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "webrtcbin")) {
+				gst_object_unref(object);
+				return TRUE;
+			}
+		}
+		parent = gst_object_get_parent(object);
+		gst_object_unref(object);
+		object = parent;
+	}
+	return FALSE;
+}
+
+/* Synchronous bus handler: messages are handled in the thread that posted them */
+static GstBusSyncReply whip_bus_sync_handler(GstBus *bus, GstMessage *msg, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_STREAM_STATUS) {
+		/* A streaming thread is starting: pin it to the right cores, depending
+		 * on whether it belongs to webrtcbin (network) or to our pipelines
+		 * (capture/encoding); threads spawned by encoders inherit this too */
+		GstStreamStatusType type;
+		GstElement *owner = NULL;
+		gst_message_parse_stream_status(msg, &type, &owner);
+		if(type == GST_STREAM_STATUS_TYPE_ENTER && owner != NULL) {
+			gboolean network = whip_element_in_webrtcbin(owner);
+			cpu_set_t *set = network ? &s->network_cpu_set : &s->encode_cpu_set;
+			int count = network ? s->network_cpu_count : s->encode_cpu_count;
+			if(count > 0) {
+				int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+				if(res != 0) {
+					WHIP_LOG(LOG_WARN, "Couldn't pin streaming thread of '%s': %s\n",
+						GST_ELEMENT_NAME(owner), g_strerror(res));
+				} else {
+					WHIP_LOG(LOG_VERB, "Pinned streaming thread of '%s' to the %s CPUs\n",
+						GST_ELEMENT_NAME(owner), network ? "network" : "encode");
+				}
+			}
+		}
+	}
+	return GST_BUS_PASS;
+}
+
+/* Pad probe on video encoders: we make sure allocation queries coming from
+ * upstream propose a buffer pool in the format the encoder wants; video
+ * metas (custom strides and offsets) are only used if the encoder itself
+ * said it supports them, as otherwise it would read the frames wrongly */
+static GstPadProbeReturn whip_zero_copy_allocation_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+	if(query == NULL || GST_QUERY_TYPE(query) != GST_QUERY_ALLOCATION)
+		return GST_PAD_PROBE_OK;
+	/* We only care about the query after the encoder answered */
+	if(!(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_PULL))
+		return GST_PAD_PROBE_OK;
+	GstCaps *caps = NULL;
+	gboolean need_pool = FALSE;
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	gboolean video_meta = gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+	if(caps != NULL && need_pool && gst_query_get_n_allocation_pools(query) == 0) {
+		GstVideoInfo vinfo;
+		if(gst_video_info_from_caps(&vinfo, caps)) {
+			GstBufferPool *pool = gst_video_buffer_pool_new();
+			GstStructure *config = gst_buffer_pool_get_config(pool);
+			gst_buffer_pool_config_set_params(config, caps, vinfo.size, 2, 0);
+			if(video_meta)
+				gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+			if(gst_buffer_pool_set_config(pool, config)) {
+				gst_query_add_allocation_pool(query, pool, vinfo.size, 2, 0);
+				WHIP_LOG(LOG_VERB, "Proposed buffer pool for %s (%u bytes per frame)\n",
+					gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&vinfo)), (guint)vinfo.size);
+			}
+			gst_object_unref(pool);
+		}
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+/* Helper method to find the preferred raw format of an encoder (the first in its template) */
+static char *whip_zero_copy_preferred_format(GstPad *sinkpad) {
+	char *format = NULL;
+	GstCaps *caps = gst_pad_get_pad_template_caps(sinkpad);
+	if(caps != NULL && gst_caps_get_size(caps) > 0) {
+		const GValue *value = gst_structure_get_value(gst_caps_get_structure(caps, 0), "format");
+		if(value != NULL && GST_VALUE_HOLDS_LIST(value) && gst_value_list_get_size(value) > 0)
+			value = gst_value_list_get_value(value, 0);
+		if(value != NULL && G_VALUE_HOLDS_STRING(value))
+			format = g_value_dup_string(value);
+	}
+	if(caps != NULL)
+		gst_caps_unref(caps);
+	return format;
+}
+
+/* Helper method to replace (or skip) a converter feeding an encoder, if redundant */
+static void whip_zero_copy_converter(GstElement *conv, const char *format) {
+	char *name = gst_element_get_name(conv);
+	GstPad *conv_sink = gst_element_get_static_pad(conv, "sink");
+	GstPad *conv_src = gst_element_get_static_pad(conv, "src");
+	GstPad *upstream = conv_sink ? gst_pad_get_peer(conv_sink) : NULL;
+	GstPad *downstream = conv_src ? gst_pad_get_peer(conv_src) : NULL;
+	GstObject *parent = gst_object_get_parent(GST_OBJECT(conv));
+	if(upstream == NULL || downstream == NULL || parent == NULL || !GST_IS_BIN(parent))
+		goto done;
+	/* Check what upstream can produce, and what downstream accepts */
+	GstCaps *up_caps = gst_pad_query_caps(upstream, NULL);
+	GstCaps *down_caps = gst_pad_query_caps(downstream, NULL);
+	GstCaps *preferred = format ? gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, format, NULL) : NULL;
+	GstElement *replacement = NULL;
+	gboolean redundant = TRUE;
+	if(preferred != NULL && gst_caps_can_intersect(up_caps, preferred) && gst_caps_can_intersect(down_caps, preferred)) {
+		/* Upstream can give us what the encoder wants, enforce that format */
+		replacement = gst_element_factory_make("capsfilter", NULL);
+		g_object_set(replacement, "caps", preferred, NULL);
+	} else if(!gst_caps_can_intersect(up_caps, down_caps)) {
+		/* We really need a conversion here */
+		redundant = FALSE;
+	}
+	gst_caps_unref(up_caps);
+	gst_caps_unref(down_caps);
+	if(preferred != NULL)
+		gst_caps_unref(preferred);
+	if(!redundant) {
+		WHIP_PREFIX(LOG_INFO, "  -- Converter '%s' is needed, keeping it\n", name);
+		goto done;
+	}
+	/* Get rid of the converter */
+	gst_pad_unlink(upstream, conv_sink);
+	gst_pad_unlink(conv_src, downstream);
+	gst_element_set_state(conv, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(parent), conv);
+	if(replacement == NULL) {
+		WHIP_PREFIX(LOG_INFO, "  -- Skipping redundant converter '%s'\n", name);
+		if(gst_pad_link(upstream, downstream) != GST_PAD_LINK_OK)
+			WHIP_LOG(LOG_ERR, "Error linking elements around '%s'\n", name);
+	} else {
+		WHIP_PREFIX(LOG_INFO, "  -- Replacing converter '%s' with a %s capsfilter\n", name, format);
+		gst_bin_add(GST_BIN(parent), replacement);
+		GstPad *rsink = gst_element_get_static_pad(replacement, "sink");
+		GstPad *rsrc = gst_element_get_static_pad(replacement, "src");
+		if(gst_pad_link(upstream, rsink) != GST_PAD_LINK_OK || gst_pad_link(rsrc, downstream) != GST_PAD_LINK_OK)
+			WHIP_LOG(LOG_ERR, "Error linking capsfilter in place of '%s'\n", name);
+		gst_object_unref(rsink);
+		gst_object_unref(rsrc);
+		gst_element_sync_state_with_parent(replacement);
+	}
+
+done:
+	if(upstream != NULL)
+		gst_object_unref(upstream);
+	if(downstream != NULL)
+		gst_object_unref(downstream);
+	if(conv_sink != NULL)
+		gst_object_unref(conv_sink);
+	if(conv_src != NULL)
+		gst_object_unref(conv_src);
+	if(parent != NULL)
+		gst_object_unref(parent);
+	g_free(name);
+}
+
+/* Callback invoked for each element in the pipeline, to find video encoders */
+static void whip_zero_copy_find_encoders(const GValue *item, gpointer user_data) {
+	GList **encoders = (GList **)user_data;
+	GstElement *element = g_value_get_object(item);
+	if(whip_element_has_klass(element, "Encoder") && whip_element_has_klass(element, "Video"))
+		*encoders = g_list_append(*encoders, gst_object_ref(element));
+}
+
+/* Helper method to minimize allocations and copies in the raw video branch */
+static void whip_zero_copy_setup(whip_session *s) {
+	WHIP_PREFIX(LOG_INFO, "Optimizing allocations in the raw video branch\n");
+	/* We collect encoders first, since we may change the pipeline */
+	GList *encoders = NULL, *temp = NULL;
+	whip_foreach_element(s->bin, (GstIteratorForeachFunction)whip_zero_copy_find_encoders, &encoders);
+	for(temp = encoders; temp != NULL; temp = temp->next) {
+		GstElement *encoder = (GstElement *)temp->data;
+		GstPad *sinkpad = gst_element_get_static_pad(encoder, "sink");
+		if(sinkpad == NULL)
+			continue;
+		gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+			whip_zero_copy_allocation_probe, NULL, NULL);
+		char *format = whip_zero_copy_preferred_format(sinkpad);
+		/* Look for a converter upstream, skipping queues */
+		GstElement *conv = NULL;
+		GstPad *pad = gst_object_ref(sinkpad);
+		while(pad != NULL) {
+			GstPad *peer = gst_pad_get_peer(pad);
+			gst_object_unref(pad);
+			pad = NULL;
+			if(peer == NULL)
+				break;
+			GstElement *up = gst_pad_get_parent_element(peer);
+			gst_object_unref(peer);
+			if(up == NULL)
+				break;
+			GstElementFactory *factory = gst_element_get_factory(up);
+			const char *fname = factory ? GST_OBJECT_NAME(factory) : "";
+			if(!strcmp(fname, "videoconvert")) {
+				conv = up;
+				break;
+			} else if(!strcmp(fname, "queue")) {
+				pad = gst_element_get_static_pad(up, "sink");
+			}
+			gst_object_unref(up);
+		}
+		if(conv != NULL) {
+			whip_zero_copy_converter(conv, format);
+			gst_object_unref(conv);
+		}
+		g_free(format);
+		gst_object_unref(sinkpad);
+	}
+	g_list_free_full(encoders, (GDestroyNotify)gst_object_unref);
+}
+
+/* Thread to create a throwaway dtlsdec, which generates the certificate
+ * all dtlsdec instances in this process share when not given one */
+static gpointer whip_dtls_warmup_thread(gpointer user_data) {
+	GstElement *dtls = gst_element_factory_make("dtlsdec", NULL);
+	if(dtls != NULL)
+		gst_object_unref(dtls);
+	WHIP_LOG(LOG_VERB, "DTLS certificate ready\n");
+	return NULL;
+}
+
+/* Helper method to generate the DTLS certificate off the critical path,
+ * so that keygen overlaps with OPTIONS and with the pipeline setup */
+static void whip_dtls_warmup(void) {
+	static gsize warmup = 0;
+	if(g_once_init_enter(&warmup)) {
+		GError *error = NULL;
+		GThread *thread = g_thread_try_new("whip dtls", whip_dtls_warmup_thread, NULL, &error);
+		if(thread == NULL) {
+			WHIP_LOG(LOG_WARN, "Couldn't start DTLS warmup thread: %s\n", error->message);
+			g_error_free(error);
+		} else {
+			g_thread_unref(thread);
+		}
+		g_once_init_leave(&warmup, 1);
+	}
+}
+
+/* Helper method to use (or save) our persistent DTLS certificate in a dtlsdec */
+static void whip_dtls_set_certificate(whip_session *s, GstElement *dtls) {
+	if(s->dtls_pem != NULL) {
+		g_object_set(dtls, "pem", s->dtls_pem, NULL);
+		return;
+	}
+	/* No certificate yet, save the one dtlsdec is using for next time */
+	g_object_get(dtls, "pem", &s->dtls_pem, NULL);
+	if(s->dtls_pem == NULL)
+		return;
+	/* Never overwrite an existing file, even if we couldn't use it */
+	if(g_file_test(s->config.dtls_pem, G_FILE_TEST_EXISTS))
+		return;
+	/* The file contains the private key, so it's created as only readable by us */
+	GError *error = NULL;
+	if(!g_file_set_contents_full(s->config.dtls_pem, s->dtls_pem, -1,
+			G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error)) {
+		WHIP_LOG(LOG_WARN, "Couldn't save DTLS certificate: %s\n", error->message);
+		g_error_free(error);
+		return;
+	}
+	WHIP_PREFIX(LOG_INFO, "Saved DTLS certificate to %s\n", s->config.dtls_pem);
+}
+
+/* Callback invoked for each element in webrtcbin, to find dtlsdec instances */
+static void whip_dtls_find_element(const GValue *item, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstElement *element = g_value_get_object(item);
+	GstElementFactory *factory = gst_element_get_factory(element);
+	if(factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "dtlsdec"))
+		whip_dtls_set_certificate(s, element);
+}
+
+/* Callback invoked when webrtcbin creates new elements (e.g., transports) */
+static void whip_dtls_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstElementFactory *factory = gst_element_get_factory(element);
+	if(factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "dtlsdec"))
+		whip_dtls_set_certificate(s, element);
+}
+
+/* Helper method to enforce the persistent DTLS certificate in webrtcbin */
+static void whip_dtls_setup(whip_session *s) {
+	/* Transports may have been created already, when pads were requested */
+	GstIterator *it = gst_bin_iterate_recurse(GST_BIN(s->pc));
+	while(gst_iterator_foreach(it, whip_dtls_find_element, s) == GST_ITERATOR_RESYNC)
+		gst_iterator_resync(it);
+	gst_iterator_free(it);
+	g_signal_connect(s->pc, "deep-element-added", G_CALLBACK(whip_dtls_element_added), s);
+}
+
+/* Helper method to open or close the valves on a branch feeding a PeerConnection */
+static void whip_failover_set_valves(GPtrArray *valves, gboolean drop) {
+	if(valves == NULL)
+		return;
+	guint i = 0;
+	for(i = 0; i < valves->len; i++)
+		g_object_set(g_ptr_array_index(valves, i), "drop", drop, NULL);
+}
+
+/* Helper method to ask encoders for a keyframe, via the valves of a branch */
+static void whip_failover_request_keyframe(GPtrArray *valves) {
+	if(valves == NULL)
+		return;
+	guint i = 0;
+	for(i = 0; i < valves->len; i++) {
+		GstPad *sinkpad = gst_element_get_static_pad(g_ptr_array_index(valves, i), "sink");
+		gst_pad_push_event(sinkpad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+		gst_object_unref(sinkpad);
+	}
+}
+
+/* Helper method to add a branch from a tee to the PeerConnection of a backup session */
+static gboolean whip_failover_link(whip_session *s, GstElement *tee, whip_session *backup, gboolean drop) {
+	GstElement *queue = gst_element_factory_make("queue", NULL);
+	GstElement *valve = gst_element_factory_make("valve", NULL);
+	if(queue == NULL || valve == NULL) {
+		WHIP_LOG(LOG_ERR, "Couldn't create queue/valve for the backup PeerConnection\n");
+		if(queue != NULL)
+			gst_object_unref(queue);
+		if(valve != NULL)
+			gst_object_unref(valve);
+		return FALSE;
+	}
+	/* Let caps through even when dropping buffers, as we need them to negotiate */
+	if(g_object_class_find_property(G_OBJECT_GET_CLASS(valve), "drop-mode"))
+		gst_util_set_object_arg(G_OBJECT(valve), "drop-mode", "forward-sticky-events");
+	g_object_set(valve, "drop", drop, NULL);
+	gst_bin_add_many(s->bin, queue, valve, NULL);
+#if GST_CHECK_VERSION(1, 20, 0)
+	GstPad *sinkpad = gst_element_request_pad_simple(backup->pc, "sink_%u");
+	GstPad *teepad = gst_element_request_pad_simple(tee, "src_%u");
+#else
+	GstPad *sinkpad = gst_element_get_request_pad(backup->pc, "sink_%u");
+	GstPad *teepad = gst_element_get_request_pad(tee, "src_%u");
+#endif
+	GstPad *valvepad = gst_element_get_static_pad(valve, "src");
+	GstPad *queuepad = gst_element_get_static_pad(queue, "sink");
+	gboolean success = (sinkpad != NULL && teepad != NULL && gst_element_link(queue, valve) &&
+		gst_pad_link(valvepad, sinkpad) == GST_PAD_LINK_OK);
+	if(success) {
+		/* Only link to the tee when the branch is ready to receive data */
+		gst_element_sync_state_with_parent(backup->pc);
+		gst_element_sync_state_with_parent(valve);
+		gst_element_sync_state_with_parent(queue);
+		success = (gst_pad_link(teepad, queuepad) == GST_PAD_LINK_OK);
+	}
+	if(success)
+		g_ptr_array_add(backup->valves, gst_object_ref(valve));
+	else
+		WHIP_LOG(LOG_ERR, "Couldn't link the backup PeerConnection\n");
+	if(sinkpad != NULL)
+		gst_object_unref(sinkpad);
+	if(teepad != NULL)
+		gst_object_unref(teepad);
+	gst_object_unref(valvepad);
+	gst_object_unref(queuepad);
+	return success;
+}
+
+/* Callback invoked when the state of a backup session changes */
+static void whip_failover_state_changed(whip_session *backup, whip_session_state state, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(backup != s->backup)
+		return;
+	if(!s->backup_active) {
+		if(state == WHIP_SESSION_CONNECTED)
+			WHIP_PREFIX(LOG_INFO, "Hot standby to %s ready\n", backup->config.url);
+		return;
+	}
+	/* The backup session is the one publishing, reflect its state */
+	if(state == WHIP_SESSION_CONNECTING || state == WHIP_SESSION_CONNECTED)
+		whip_set_state(s, state);
+}
+
+/* Backup session that was torn down, and why */
+typedef struct whip_failover_event {
+	whip_session *s, *backup;
+	char *reason;
+} whip_failover_event;
+
+static void whip_failover_event_free(whip_failover_event *event) {
+	g_free(event->reason);
+	g_free(event);
+}
+
+/* Main context callback to handle a backup session that was torn down */
+static gboolean whip_failover_backup_failed(gpointer user_data) {
+	whip_failover_event *event = (whip_failover_event *)user_data;
+	whip_session *s = event->s, *backup = event->backup;
+	if(backup != s->backup || g_atomic_int_get(&s->stopping))
+		return G_SOURCE_REMOVE;
+	/* We can't free the session from its own callback, do it later */
+	gboolean active = s->backup_active;
+	s->backup = NULL;
+	s->backup_active = FALSE;
+	s->retired = g_list_prepend(s->retired, backup);
+	whip_failover_set_valves(backup->valves, TRUE);
+	if(!active) {
+		WHIP_LOG(LOG_WARN, "Hot standby to %s failed (%s)\n", backup->config.url, event->reason);
+		return G_SOURCE_REMOVE;
+	}
+	/* The backup we were publishing to failed too, try the next one */
+	if(!whip_failover(s, event->reason))
+		whip_teardown(s, event->reason);
+	return G_SOURCE_REMOVE;
+}
+
+/* Callback invoked when a backup session is torn down */
+static void whip_failover_disconnected(whip_session *backup, const char *reason, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->stopping))
+		return;
+	/* We may be in a GStreamer thread, so we update our state in the main context */
+	whip_failover_event *event = g_malloc0(sizeof(whip_failover_event));
+	event->s = s;
+	event->backup = backup;
+	event->reason = g_strdup(reason);
+	g_main_context_invoke_full(s->context, G_PRIORITY_DEFAULT, whip_failover_backup_failed,
+		event, (GDestroyNotify)whip_failover_event_free);
+}
+
+/* Helper method to create a session to the next backup endpoint, sharing our encoders */
+static gboolean whip_failover_create(whip_session *s, gboolean standby) {
+	const char *url = s->config.backup_urls[s->next_backup];
+	if(url == NULL)
+		return FALSE;
+	s->next_backup++;
+	WHIP_PREFIX(LOG_INFO, "Creating %s session to %s\n", standby ? "hot standby" : "backup", url);
+	GstElement *webrtc = gst_element_factory_make("webrtcbin", NULL);
+	if(webrtc == NULL) {
+		WHIP_LOG(LOG_ERR, "Couldn't create webrtcbin for the backup session\n");
+		return FALSE;
+	}
+	gst_bin_add(s->bin, webrtc);
+	/* The backup session inherits our configuration, except for what has
+	 * to do with the pipeline, which stays ours (it just gets attached):
+	 * this includes the pacer (which is before the tees) and the media
+	 * controllers, which keep on running here on the active PeerConnection */
+	whip_config *config = whip_config_new();
+	*config = s->config;
+	config->url = url;
+	config->audio_pipe = NULL;
+	config->video_pipe = NULL;
+	config->eos_sink_name = NULL;
+	config->latency_probe = FALSE;
+	config->profile = FALSE;
+	config->video_codec = NULL;
+	config->encode_cpus = NULL;
+	config->network_cpus = NULL;
+	config->zero_copy = FALSE;
+	config->standby = FALSE;
+	config->backup_urls = NULL;
+	config->hot_standby = FALSE;
+	config->race_urls = NULL;
+	config->pacing_factor = 0;
+	config->degradation = NULL;
+	whip_session *backup = whip_session_new(config);
+	whip_config_free(config);
+	if(backup != NULL)
+		backup->primary = s;
+	if(backup == NULL || !whip_session_attach(backup, webrtc)) {
+		if(backup != NULL)
+			whip_session_free(backup);
+		gst_element_set_state(webrtc, GST_STATE_NULL);
+		gst_bin_remove(s->bin, webrtc);
+		return FALSE;
+	}
+	whip_callbacks callbacks = { 0 };
+	callbacks.state_changed = whip_failover_state_changed;
+	callbacks.disconnected = whip_failover_disconnected;
+	whip_session_set_callbacks(backup, &callbacks, s);
+	backup->valves = g_ptr_array_new_with_free_func((GDestroyNotify)gst_object_unref);
+	s->backup = backup;
+	s->backup_active = !standby;
+	/* Start the session first, as we need its callbacks before linking */
+	gboolean success = whip_session_start(backup);
+	if(success && s->tees[0] != NULL)
+		success = whip_failover_link(s, s->tees[0], backup, standby);
+	if(success && s->tees[1] != NULL)
+		success = whip_failover_link(s, s->tees[1], backup, standby);
+	if(!success) {
+		WHIP_LOG(LOG_ERR, "Error creating session to %s\n", url);
+		s->backup = NULL;
+		s->backup_active = FALSE;
+		whip_failover_set_valves(backup->valves, TRUE);
+		s->retired = g_list_prepend(s->retired, backup);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Main context callback to prepare a hot standby session */
+static gboolean whip_failover_standby(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->stopping) || g_atomic_int_get(&s->primary_failed) || s->backup != NULL)
+		return G_SOURCE_REMOVE;
+	whip_failover_create(s, TRUE);
+	return G_SOURCE_REMOVE;
+}
+
+/* Main context callback to switch to the backup endpoint */
+static gboolean whip_failover_switch(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->stopping) || g_atomic_int_get(&s->disconnected))
+		return G_SOURCE_REMOVE;
+	/* Stop feeding the PeerConnection that failed */
+	whip_failover_set_valves(s->valves, TRUE);
+	if(s->backup != NULL && !s->backup_active && s->backup->public_state == WHIP_SESSION_CONNECTED) {
+		/* We have a hot standby, start sending media there */
+		s->backup_active = TRUE;
+		whip_failover_set_valves(s->backup->valves, FALSE);
+		whip_failover_request_keyframe(s->backup->valves);
+		WHIP_PREFIX(LOG_INFO, "Switched to hot standby %s\n", s->backup->config.url);
+		return G_SOURCE_REMOVE;
+	}
+	if(s->backup != NULL) {
+		/* The standby isn't ready, get rid of it */
+		whip_session *backup = s->backup;
+		s->backup = NULL;
+		s->retired = g_list_prepend(s->retired, backup);
+		whip_session_stop(backup, "Standby not ready");
+	}
+	/* Negotiate a new session with the next backup endpoint */
+	whip_set_state(s, WHIP_SESSION_CONNECTING);
+	while(s->config.backup_urls[s->next_backup] != NULL) {
+		if(whip_failover_create(s, FALSE))
+			return G_SOURCE_REMOVE;
+	}
+	whip_teardown(s, "No backup endpoint available");
+	return G_SOURCE_REMOVE;
+}
+
+/* Helper method to check if we can fail over and, if so, schedule the switch */
+static gboolean whip_failover(whip_session *s, const char *reason) {
+	if(s->config.backup_urls == NULL || s->valves == NULL)
+		return FALSE;
+	gboolean hot = (s->backup != NULL && !s->backup_active && s->backup->public_state == WHIP_SESSION_CONNECTED);
+	if(!hot && s->config.backup_urls[s->next_backup] == NULL)
+		return FALSE;
+	WHIP_PREFIX(LOG_WARN, "Publishing failed (%s), failing over to %s\n", reason,
+		hot ? s->backup->config.url : s->config.backup_urls[s->next_backup]);
+	/* We may be in a GStreamer thread, so we switch in the main context */
+	g_main_context_invoke(s->context, whip_failover_switch, s);
+	return TRUE;
+}
+
+/* Helper method to read the ICE servers cache (a JSON object, indexed by endpoint) */
+static JsonObject *whip_ice_cache_read(const char *path) {
+	JsonObject *cache = NULL;
+	JsonParser *parser = json_parser_new();
+	if(g_file_test(path, G_FILE_TEST_EXISTS) && json_parser_load_from_file(parser, path, NULL)) {
+		JsonNode *root = json_parser_get_root(parser);
+		if(root != NULL && JSON_NODE_HOLDS_OBJECT(root))
+			cache = json_object_ref(json_node_get_object(root));
+	}
+	g_object_unref(parser);
+	if(cache == NULL)
+		cache = json_object_new();
+	return cache;
+}
+
+/* Helper method to find out when the credentials in a TURN server expire:
+ * with the TURN REST API, the username is in the timestamp:username format */
+static gint64 whip_ice_cache_turn_expiry(const char *server) {
+	const char *userinfo = strstr(server, "://");
+	if(userinfo == NULL || strchr(userinfo, '@') == NULL)
+		return 0;
+	userinfo += 3;
+	/* The username is escaped, so the first colon separates it from the password */
+	char *username = g_strndup(userinfo, strcspn(userinfo, ":@"));
+	char *unescaped = g_uri_unescape_string(username, NULL);
+	g_free(username);
+	if(unescaped == NULL)
+		return 0;
+	char *end = NULL;
+	gint64 timestamp = g_ascii_strtoll(unescaped, &end, 10);
+	gboolean rest = (end != unescaped && (*end == ':' || *end == '\0') && timestamp > 1000000000);
+	g_free(unescaped);
+	return rest ? timestamp : 0;
+}
+
+/* Helper method to use the cached STUN/TURN servers for our endpoint, if still valid */
+static gboolean whip_ice_cache_load(whip_session *s) {
+	JsonObject *cache = whip_ice_cache_read(s->config.ice_cache);
+	JsonObject *entry = json_object_has_member(cache, s->config.url) ?
+		json_object_get_object_member(cache, s->config.url) : NULL;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	gint64 expires = (entry && json_object_has_member(entry, "expires")) ?
+		json_object_get_int_member(entry, "expires") : 0;
+	if(entry == NULL || expires <= now) {
+		WHIP_LOG(LOG_VERB, "No valid cached STUN/TURN servers for %s\n", s->config.url);
+		json_object_unref(cache);
+		return FALSE;
+	}
+	s->stun_server = NULL;
+	s->turn_server = NULL;
+	WHIP_PREFIX(LOG_INFO, "Using cached STUN/TURN servers (expire in %"G_GINT64_FORMAT"s):\n", expires - now);
+	if(json_object_has_member(entry, "stun")) {
+		s->auto_stun_server = g_strdup(json_object_get_string_member(entry, "stun"));
+		WHIP_PREFIX(LOG_INFO, "  -- -- %s\n", s->auto_stun_server);
+	}
+	JsonArray *turn = json_object_has_member(entry, "turn") ?
+		json_object_get_array_member(entry, "turn") : NULL;
+	if(turn != NULL && json_array_get_length(turn) > 0) {
+		guint i = 0, count = json_array_get_length(turn);
+		s->auto_turn_server = g_malloc0((count+1)*sizeof(gpointer));
+		for(i = 0; i < count; i++) {
+			s->auto_turn_server[i] = g_strdup(json_array_get_string_element(turn, i));
+			WHIP_PREFIX(LOG_INFO, "  -- -- %s\n", s->auto_turn_server[i]);
+		}
+	}
+	WHIP_LOG(LOG_INFO, "\n");
+	json_object_unref(cache);
+	return TRUE;
+}
+
+/* Helper method to cache the STUN/TURN servers we got for our endpoint */
+static void whip_ice_cache_store(whip_session *s) {
+	if(s->auto_stun_server == NULL && s->auto_turn_server == NULL)
+		return;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	gint64 expires = now + (s->config.ice_cache_ttl > 0 ? s->config.ice_cache_ttl : 3600);
+	JsonObject *entry = json_object_new();
+	if(s->auto_stun_server != NULL)
+		json_object_set_string_member(entry, "stun", s->auto_stun_server);
+	if(s->auto_turn_server != NULL) {
+		JsonArray *turn = json_array_new();
+		int i = 0;
+		while(s->auto_turn_server[i] != NULL) {
+			/* Don't keep the entry beyond the expiration of TURN credentials,
+			 * with some margin to actually allocate when we need them */
+			gint64 turn_expires = whip_ice_cache_turn_expiry(s->auto_turn_server[i]);
+			if(turn_expires > 0 && turn_expires - 60 < expires)
+				expires = turn_expires - 60;
+			json_array_add_string_element(turn, s->auto_turn_server[i]);
+			i++;
+		}
+		json_object_set_array_member(entry, "turn", turn);
+	}
+	if(expires <= now) {
+		WHIP_LOG(LOG_VERB, "TURN credentials expire too soon, not caching them\n");
+		json_object_unref(entry);
+		return;
+	}
+	json_object_set_int_member(entry, "expires", expires);
+	/* Update the cache, getting rid of expired entries while we're at it */
+	JsonObject *cache = whip_ice_cache_read(s->config.ice_cache);
+	GList *endpoints = json_object_get_members(cache), *temp = NULL;
+	for(temp = endpoints; temp != NULL; temp = temp->next) {
+		JsonNode *node = json_object_get_member(cache, (const char *)temp->data);
+		if(!JSON_NODE_HOLDS_OBJECT(node) || json_object_get_int_member_with_default(
+				json_node_get_object(node), "expires", 0) <= now)
+			json_object_remove_member(cache, (const char *)temp->data);
+	}
+	g_list_free(endpoints);
+	json_object_set_object_member(cache, s->config.url, entry);
+	JsonNode *root = json_node_new(JSON_NODE_OBJECT);
+	json_node_take_object(root, cache);
+	char *text = json_to_string(root, TRUE);
+	json_node_unref(root);
+	/* The cache may contain TURN credentials, so it's only readable by us */
+	GError *error = NULL;
+	if(!g_file_set_contents_full(s->config.ice_cache, text, -1,
+			G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error)) {
+		WHIP_LOG(LOG_WARN, "Couldn't save the STUN/TURN servers cache: %s\n", error->message);
+		g_error_free(error);
+	} else {
+		WHIP_LOG(LOG_VERB, "Cached STUN/TURN servers for %s\n", s->config.url);
+	}
+	g_free(text);
+}
+
+/* DNS cache: we install a resolver that wraps the default one as the
+ * default, so that both libsoup and webrtcbin (for STUN/TURN servers) use
+ * it. Lookups are always for all address families, and served filtered
+ * when a specific family is asked for: this way, the separate IPv4 and
+ * IPv6 lookups GSocketClient does when racing connections (happy eyeballs)
+ * share the same cached result. Lookups happen in a dedicated thread, so
+ * that synchronous lookups can wait for the ones already in progress */
+typedef struct _WhipResolver {
+	GResolver parent;
+	/* Resolver we wrap */
+	GResolver *inner;
+	/* Cached lookups, indexed by hostname */
+	GHashTable *cache;
+	/* How long to cache lookups for, in microseconds */
+	gint64 ttl;
+	GMutex mutex;
+	GCond cond;
+} WhipResolver;
+typedef struct _WhipResolverClass {
+	GResolverClass parent_class;
+} WhipResolverClass;
+
+GType whip_resolver_get_type(void);
+#define WHIP_TYPE_RESOLVER (whip_resolver_get_type())
+#define WHIP_RESOLVER(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), WHIP_TYPE_RESOLVER, WhipResolver))
+G_DEFINE_TYPE(WhipResolver, whip_resolver, G_TYPE_RESOLVER);
+
+/* Cached lookup */
+typedef struct whip_dns_entry {
+	/* Addresses (or error) of the latest lookup, and when they expire */
+	GList *addresses;
+	GError *error;
+	gint64 expires;
+	/* Whether a lookup is in progress, and the GTasks waiting for it */
+	gboolean pending;
+	GList *waiters;
+} whip_dns_entry;
+static void whip_dns_entry_free(whip_dns_entry *entry) {
+	g_resolver_free_addresses(entry->addresses);
+	g_clear_error(&entry->error);
+	g_free(entry);
+}
+
+/* The resolver we installed, if any */
+static WhipResolver *whip_dns = NULL;
+static GMutex whip_dns_mutex;
+
+/* Helper method to only return the addresses of the family that was asked for */
+static GList *whip_dns_filter(const char *hostname, GList *addresses,
+		GResolverNameLookupFlags flags, GError **error) {
+	GList *result = NULL, *temp = NULL;
+	for(temp = addresses; temp != NULL; temp = temp->next) {
+		GSocketFamily family = g_inet_address_get_family(G_INET_ADDRESS(temp->data));
+		if((flags & G_RESOLVER_NAME_LOOKUP_FLAGS_IPV4_ONLY) && family != G_SOCKET_FAMILY_IPV4)
+			continue;
+		if((flags & G_RESOLVER_NAME_LOOKUP_FLAGS_IPV6_ONLY) && family != G_SOCKET_FAMILY_IPV6)
+			continue;
+		result = g_list_prepend(result, g_object_ref(temp->data));
+	}
+	if(result == NULL) {
+		g_set_error(error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND,
+			"No suitable addresses for '%s'", hostname);
+	}
+	return g_list_reverse(result);
+}
+
+/* Thread performing an actual lookup, and notifying whoever's waiting for it */
+static gpointer whip_dns_lookup_thread(gpointer data) {
+	/* The thread owns a reference to the resolver, and the hostname */
+	gpointer *lookup = (gpointer *)data;
+	WhipResolver *r = lookup[0];
+	char *hostname = lookup[1];
+	g_free(lookup);
+	GError *error = NULL;
+	gint64 start = g_get_monotonic_time();
+	GList *addresses = g_resolver_lookup_by_name(r->inner, hostname, NULL, &error);
+	if(error != NULL) {
+		WHIP_LOG(LOG_WARN, "Couldn't resolve %s: %s\n", hostname, error->message);
+	} else {
+		WHIP_LOG(LOG_VERB, "Resolved %s (%u addresses) in %"G_GINT64_FORMAT"ms\n",
+			hostname, g_list_length(addresses), (g_get_monotonic_time() - start)/1000);
+	}
+	g_mutex_lock(&r->mutex);
+	whip_dns_entry *entry = g_hash_table_lookup(r->cache, hostname);
+	g_resolver_free_addresses(entry->addresses);
+	g_clear_error(&entry->error);
+	entry->addresses = addresses;
+	entry->error = error;
+	entry->expires = error ? 0 : g_get_monotonic_time() + r->ttl;
+	entry->pending = FALSE;
+	GList *waiters = entry->waiters, *temp = NULL;
+	entry->waiters = NULL;
+	for(temp = waiters; temp != NULL; temp = temp->next) {
+		GTask *task = G_TASK(temp->data);
+		GResolverNameLookupFlags flags = GPOINTER_TO_INT(g_task_get_task_data(task));
+		GError *task_error = NULL;
+		GList *result = NULL;
+		if(error != NULL)
+			task_error = g_error_copy(error);
+		else
+			result = whip_dns_filter(hostname, addresses, flags, &task_error);
+		if(task_error != NULL)
+			g_task_return_error(task, task_error);
+		else
+			g_task_return_pointer(task, result, (GDestroyNotify)g_resolver_free_addresses);
+		g_object_unref(task);
+	}
+	g_list_free(waiters);
+	g_cond_broadcast(&r->cond);
+	g_mutex_unlock(&r->mutex);
+	g_free(hostname);
+	g_object_unref(r);
+	return NULL;
+}
+
+/* Helper method to get the entry for a host, starting a lookup if we
+ * don't have valid cached addresses: must be called with the mutex locked */
+static whip_dns_entry *whip_dns_entry_get(WhipResolver *r, const char *hostname) {
+	whip_dns_entry *entry = g_hash_table_lookup(r->cache, hostname);
+	if(entry == NULL) {
+		entry = g_malloc0(sizeof(whip_dns_entry));
+		g_hash_table_insert(r->cache, g_strdup(hostname), entry);
+	}
+	if(!entry->pending && entry->expires <= g_get_monotonic_time()) {
+		entry->pending = TRUE;
+		gpointer *lookup = g_malloc(2 * sizeof(gpointer));
+		lookup[0] = g_object_ref(r);
+		lookup[1] = g_strdup(hostname);
+		GThread *thread = g_thread_try_new("whip dns", whip_dns_lookup_thread, lookup, NULL);
+		if(thread == NULL) {
+			/* Shouldn't happen, but better to resolve in place than to hang */
+			g_mutex_unlock(&r->mutex);
+			whip_dns_lookup_thread(lookup);
+			g_mutex_lock(&r->mutex);
+		} else {
+			g_thread_unref(thread);
+		}
+	}
+	return entry;
+}
+
+/* Name lookups (cached) */
+static GList *whip_resolver_lookup_by_name_with_flags(GResolver *resolver, const gchar *hostname,
+		GResolverNameLookupFlags flags, GCancellable *cancellable, GError **error) {
+	WhipResolver *r = WHIP_RESOLVER(resolver);
+	GList *result = NULL;
+	g_mutex_lock(&r->mutex);
+	whip_dns_entry *entry = whip_dns_entry_get(r, hostname);
+	while(entry->pending)
+		g_cond_wait(&r->cond, &r->mutex);
+	if(entry->error != NULL)
+		g_propagate_error(error, g_error_copy(entry->error));
+	else
+		result = whip_dns_filter(hostname, entry->addresses, flags, error);
+	g_mutex_unlock(&r->mutex);
+	if(result != NULL && g_cancellable_set_error_if_cancelled(cancellable, error)) {
+		g_resolver_free_addresses(result);
+		result = NULL;
+	}
+	return result;
+}
+static GList *whip_resolver_lookup_by_name(GResolver *resolver, const gchar *hostname,
+		GCancellable *cancellable, GError **error) {
+	return whip_resolver_lookup_by_name_with_flags(resolver, hostname,
+		G_RESOLVER_NAME_LOOKUP_FLAGS_DEFAULT, cancellable, error);
+}
+static void whip_resolver_lookup_by_name_with_flags_async(GResolver *resolver, const gchar *hostname,
+		GResolverNameLookupFlags flags, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	WhipResolver *r = WHIP_RESOLVER(resolver);
+	GTask *task = g_task_new(resolver, cancellable, callback, user_data);
+	g_task_set_task_data(task, GINT_TO_POINTER(flags), NULL);
+	g_mutex_lock(&r->mutex);
+	whip_dns_entry *entry = whip_dns_entry_get(r, hostname);
+	if(entry->pending) {
+		/* We'll be notified when the lookup is done */
+		entry->waiters = g_list_append(entry->waiters, task);
+		g_mutex_unlock(&r->mutex);
+		return;
+	}
+	GError *error = NULL;
+	GList *result = NULL;
+	if(entry->error != NULL)
+		error = g_error_copy(entry->error);
+	else
+		result = whip_dns_filter(hostname, entry->addresses, flags, &error);
+	g_mutex_unlock(&r->mutex);
+	if(error != NULL)
+		g_task_return_error(task, error);
+	else
+		g_task_return_pointer(task, result, (GDestroyNotify)g_resolver_free_addresses);
+	g_object_unref(task);
+}
+static void whip_resolver_lookup_by_name_async(GResolver *resolver, const gchar *hostname,
+		GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	whip_resolver_lookup_by_name_with_flags_async(resolver, hostname,
+		G_RESOLVER_NAME_LOOKUP_FLAGS_DEFAULT, cancellable, callback, user_data);
+}
+static GList *whip_resolver_lookup_by_name_finish(GResolver *resolver, GAsyncResult *result, GError **error) {
+	return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/* Other lookups are simply forwarded to the resolver we wrap */
+static gchar *whip_resolver_lookup_by_address(GResolver *resolver, GInetAddress *address,
+		GCancellable *cancellable, GError **error) {
+	return g_resolver_lookup_by_address(WHIP_RESOLVER(resolver)->inner, address, cancellable, error);
+}
+static void whip_resolver_lookup_by_address_async(GResolver *resolver, GInetAddress *address,
+		GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	g_resolver_lookup_by_address_async(WHIP_RESOLVER(resolver)->inner, address, cancellable, callback, user_data);
+}
+static gchar *whip_resolver_lookup_by_address_finish(GResolver *resolver, GAsyncResult *result, GError **error) {
+	return g_resolver_lookup_by_address_finish(WHIP_RESOLVER(resolver)->inner, result, error);
+}
+static GList *whip_resolver_lookup_service(GResolver *resolver, const gchar *rrname,
+		GCancellable *cancellable, GError **error) {
+	GResolver *inner = WHIP_RESOLVER(resolver)->inner;
+	return G_RESOLVER_GET_CLASS(inner)->lookup_service(inner, rrname, cancellable, error);
+}
+static void whip_resolver_lookup_service_async(GResolver *resolver, const gchar *rrname,
+		GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	GResolver *inner = WHIP_RESOLVER(resolver)->inner;
+	G_RESOLVER_GET_CLASS(inner)->lookup_service_async(inner, rrname, cancellable, callback, user_data);
+}
+static GList *whip_resolver_lookup_service_finish(GResolver *resolver, GAsyncResult *result, GError **error) {
+	GResolver *inner = WHIP_RESOLVER(resolver)->inner;
+	return G_RESOLVER_GET_CLASS(inner)->lookup_service_finish(inner, result, error);
+}
+static GList *whip_resolver_lookup_records(GResolver *resolver, const gchar *rrname,
+		GResolverRecordType record_type, GCancellable *cancellable, GError **error) {
+	return g_resolver_lookup_records(WHIP_RESOLVER(resolver)->inner, rrname, record_type, cancellable, error);
+}
+static void whip_resolver_lookup_records_async(GResolver *resolver, const gchar *rrname,
+		GResolverRecordType record_type, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	g_resolver_lookup_records_async(WHIP_RESOLVER(resolver)->inner, rrname, record_type, cancellable, callback, user_data);
+}
+static GList *whip_resolver_lookup_records_finish(GResolver *resolver, GAsyncResult *result, GError **error) {
+	return g_resolver_lookup_records_finish(WHIP_RESOLVER(resolver)->inner, result, error);
+}
+
+static void whip_resolver_finalize(GObject *object) {
+	WhipResolver *r = WHIP_RESOLVER(object);
+	g_clear_object(&r->inner);
+	g_hash_table_destroy(r->cache);
+	g_mutex_clear(&r->mutex);
+	g_cond_clear(&r->cond);
+	G_OBJECT_CLASS(whip_resolver_parent_class)->finalize(object);
+}
+
+static void whip_resolver_init(WhipResolver *r) {
+	r->cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)whip_dns_entry_free);
+	g_mutex_init(&r->mutex);
+	g_cond_init(&r->cond);
+}
+
+static void whip_resolver_class_init(WhipResolverClass *klass) {
+	G_OBJECT_CLASS(klass)->finalize = whip_resolver_finalize;
+	GResolverClass *resolver_class = G_RESOLVER_CLASS(klass);
+	resolver_class->lookup_by_name = whip_resolver_lookup_by_name;
+	resolver_class->lookup_by_name_async = whip_resolver_lookup_by_name_async;
+	resolver_class->lookup_by_name_finish = whip_resolver_lookup_by_name_finish;
+	resolver_class->lookup_by_name_with_flags = whip_resolver_lookup_by_name_with_flags;
+	resolver_class->lookup_by_name_with_flags_async = whip_resolver_lookup_by_name_with_flags_async;
+	resolver_class->lookup_by_name_with_flags_finish = whip_resolver_lookup_by_name_finish;
+	resolver_class->lookup_by_address = whip_resolver_lookup_by_address;
+	resolver_class->lookup_by_address_async = whip_resolver_lookup_by_address_async;
+	resolver_class->lookup_by_address_finish = whip_resolver_lookup_by_address_finish;
+	resolver_class->lookup_service = whip_resolver_lookup_service;
+	resolver_class->lookup_service_async = whip_resolver_lookup_service_async;
+	resolver_class->lookup_service_finish = whip_resolver_lookup_service_finish;
+	resolver_class->lookup_records = whip_resolver_lookup_records;
+	resolver_class->lookup_records_async = whip_resolver_lookup_records_async;
+	resolver_class->lookup_records_finish = whip_resolver_lookup_records_finish;
+}
+
+/* Install the caching resolver as the default one for the process */
+void whip_dns_cache_enable(int ttl) {
+	if(ttl < 1)
+		return;
+	g_mutex_lock(&whip_dns_mutex);
+	if(whip_dns == NULL) {
+		whip_dns = g_object_new(WHIP_TYPE_RESOLVER, NULL);
+		whip_dns->inner = g_resolver_get_default();
+		g_resolver_set_default(G_RESOLVER(whip_dns));
+	}
+	g_mutex_lock(&whip_dns->mutex);
+	whip_dns->ttl = (gint64)ttl * G_USEC_PER_SEC;
+	g_mutex_unlock(&whip_dns->mutex);
+	WHIP_LOG(LOG_VERB, "Caching DNS lookups for %ds\n", ttl);
+	g_mutex_unlock(&whip_dns_mutex);
+}
+
+/* Restore the resolver that was the default before we installed ours */
+void whip_dns_cache_disable(void) {
+	g_mutex_lock(&whip_dns_mutex);
+	if(whip_dns != NULL) {
+		/* Only restore it if nobody replaced ours in the meanwhile */
+		GResolver *current = g_resolver_get_default();
+		if(current == G_RESOLVER(whip_dns))
+			g_resolver_set_default(whip_dns->inner);
+		g_object_unref(current);
+		g_clear_object(&whip_dns);
+		WHIP_LOG(LOG_VERB, "Not caching DNS lookups anymore\n");
+	}
+	g_mutex_unlock(&whip_dns_mutex);
+}
+
+/* Helper method to resolve the host in a URI in the background */
+static void whip_dns_prefetch(const char *uri) {
+	if(uri == NULL)
+		return;
+	g_mutex_lock(&whip_dns_mutex);
+	WhipResolver *r = whip_dns ? g_object_ref(whip_dns) : NULL;
+	g_mutex_unlock(&whip_dns_mutex);
+	if(r == NULL)
+		return;
+	GUri *parsed = g_uri_parse(uri, G_URI_FLAGS_NONE, NULL);
+	const char *host = parsed ? g_uri_get_host(parsed) : NULL;
+	if(host != NULL && *host != '\0' && !g_hostname_is_ip_address(host)) {
+		g_mutex_lock(&r->mutex);
+		whip_dns_entry_get(r, host);
+		g_mutex_unlock(&r->mutex);
+	}
+	if(parsed != NULL)
+		g_uri_unref(parsed);
+	g_object_unref(r);
+}
+static void whip_dns_prefetch_list(const char **uris) {
+	int i = 0;
+	while(uris != NULL && uris[i] != NULL) {
+		whip_dns_prefetch(uris[i]);
+		i++;
+	}
+}
+
+/* Helper method to check if an interface name matches a comma-separated list of patterns */
+static gboolean whip_interface_matches(const char *list, const char *name) {
+	gboolean match = FALSE;
+	gchar **patterns = g_strsplit(list, ",", -1);
+	int i = 0;
+	for(i = 0; !match && patterns[i] != NULL; i++) {
+		g_strstrip(patterns[i]);
+		if(*patterns[i] != '\0' && g_pattern_match_simple(patterns[i], name))
+			match = TRUE;
+	}
+	g_strfreev(patterns);
+	return match;
+}
+
+/* Helper method to configure the ICE agent according to the candidate filters:
+ * interfaces and IP family are enforced by explicitly telling the agent which
+ * local addresses to use, before it starts gathering */
+static void whip_ice_filters_setup(whip_session *s) {
+	gboolean restrict_addresses = (s->config.ice_interfaces != NULL ||
+		s->config.ice_exclude_interfaces != NULL || s->config.ice_family != NULL);
+	if(!restrict_addresses && !s->config.ice_no_tcp)
+		return;
+#if GST_CHECK_VERSION(1, 22, 0)
+	GObject *ice = NULL;
+	g_object_get(s->pc, "ice-agent", &ice, NULL);
+	if(ice == NULL) {
+		WHIP_LOG(LOG_WARN, "Couldn't access the ICE agent, candidates will only be filtered when signalling\n");
+		return;
+	}
+	if(s->config.ice_no_tcp && g_object_class_find_property(G_OBJECT_GET_CLASS(ice), "ice-tcp"))
+		g_object_set(ice, "ice-tcp", FALSE, NULL);
+	NiceAgent *agent = NULL;
+	if(restrict_addresses && g_object_class_find_property(G_OBJECT_GET_CLASS(ice), "agent"))
+		g_object_get(ice, "agent", &agent, NULL);
+	if(restrict_addresses && agent == NULL)
+		WHIP_LOG(LOG_WARN, "Couldn't access the nice agent, candidates will only be filtered when signalling\n");
+	if(agent != NULL) {
+		struct ifaddrs *ifaddr = NULL, *ifa = NULL;
+		if(getifaddrs(&ifaddr) < 0) {
+			WHIP_LOG(LOG_WARN, "Couldn't get the local interfaces, candidates will only be filtered when signalling\n");
+		} else {
+			int added = 0;
+			for(ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+				if(ifa->ifa_addr == NULL || !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK))
+					continue;
+				int family = ifa->ifa_addr->sa_family;
+				if(family != AF_INET && family != AF_INET6)
+					continue;
+				if(family == AF_INET6 && IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr))
+					continue;
+				if(s->config.ice_family != NULL &&
+						((family == AF_INET && !strcasecmp(s->config.ice_family, "ipv6")) ||
+						(family == AF_INET6 && !strcasecmp(s->config.ice_family, "ipv4"))))
+					continue;
+				if(s->config.ice_interfaces != NULL && !whip_interface_matches(s->config.ice_interfaces, ifa->ifa_name))
+					continue;
+				if(s->config.ice_exclude_interfaces != NULL && whip_interface_matches(s->config.ice_exclude_interfaces, ifa->ifa_name))
+					continue;
+				NiceAddress address;
+				nice_address_init(&address);
+				nice_address_set_from_sockaddr(&address, ifa->ifa_addr);
+				char ip[NICE_ADDRESS_STRING_LEN];
+				nice_address_to_string(&address, ip);
+				if(nice_agent_add_local_address(agent, &address)) {
+					WHIP_PREFIX(LOG_INFO, "Gathering candidates on %s (%s)\n", ifa->ifa_name, ip);
+					added++;
+				}
+			}
+			freeifaddrs(ifaddr);
+			if(added == 0)
+				WHIP_LOG(LOG_WARN, "No local address matches the ICE filters, only relay candidates will be available\n");
+		}
+		g_object_unref(agent);
+	}
+	g_object_unref(ice);
+#else
+	WHIP_LOG(LOG_WARN, "The ICE agent can't be configured before GStreamer 1.22, candidates will only be filtered when signalling\n");
+#endif
+}
+
+/* Helper method to check if a candidate passes the filters, before we signal it */
+static gboolean whip_candidate_allowed(whip_session *s, const char *candidate) {
+	/* candidate:<foundation> <component> <transport> <priority> <address> <port> typ <type> ... */
+	gchar **parts = g_strsplit(candidate, " ", -1);
+	if(g_strv_length(parts) < 8) {
+		g_strfreev(parts);
+		return TRUE;
+	}
+	const char *transport = parts[2], *address = parts[4], *type = parts[7];
+	gboolean allowed = TRUE;
+	gboolean mdns = g_str_has_suffix(address, ".local");
+	if(s->config.ice_no_tcp && !strcasecmp(transport, "tcp"))
+		allowed = FALSE;
+	else if(s->config.ice_no_mdns && mdns)
+		allowed = FALSE;
+	else if(s->config.ice_family != NULL && !mdns &&
+			((!strcasecmp(s->config.ice_family, "ipv4") && strchr(address, ':') != NULL) ||
+			(!strcasecmp(s->config.ice_family, "ipv6") && strchr(address, ':') == NULL)))
+		allowed = FALSE;
+	if(allowed && s->config.ice_max_candidates > 0) {
+		const char *types[] = { "host", "srflx", "prflx", "relay" };
+		int i = 0;
+		for(i = 0; i < 4; i++) {
+			if(!strcasecmp(type, types[i])) {
+				if(s->candidate_counts[i] >= s->config.ice_max_candidates)
+					allowed = FALSE;
+				else
+					s->candidate_counts[i]++;
+				break;
+			}
+		}
+	}
+	g_strfreev(parts);
+	return allowed;
+}
+
+/* Helper method to set the size of a socket buffer: we try to force it first,
+ * which ignores the system limits (but needs CAP_NET_ADMIN), and then we fall
+ * back to a plain request, which is capped by net.core.[wr]mem_max */
+static int whip_udp_set_buffer(int fd, int force, int option, int size) {
+	if(setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) < 0)
+		setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size));
+	int actual = 0;
+	socklen_t len = sizeof(actual);
+	getsockopt(fd, SOL_SOCKET, option, &actual, &len);
+	/* The kernel doubles the value, to account for bookkeeping overhead */
+	return actual / 2;
+}
+
+/* Helper method to read how many datagrams the kernel dropped on our socket */
+static gboolean whip_udp_read_drops(whip_session *s, guint64 *drops) {
+	const char *files[] = { "/proc/net/udp", "/proc/net/udp6" };
+	gboolean found = FALSE;
+	int i = 0;
+	for(i = 0; !found && i < 2; i++) {
+		FILE *f = fopen(files[i], "r");
+		if(f == NULL)
+			continue;
+		char line[512];
+		/* Skip the header */
+		if(fgets(line, sizeof(line), f) == NULL) {
+			fclose(f);
+			continue;
+		}
+		while(!found && fgets(line, sizeof(line), f) != NULL) {
+			/* sl local rem st tx:rx tr:when retrnsmt uid timeout inode ref pointer drops */
+			gchar **fields = g_strsplit_set(g_strstrip(line), " ", -1);
+			int n = 0, count = 0;
+			const char *values[13] = { 0 };
+			for(n = 0; fields[n] != NULL && count < 13; n++) {
+				if(*fields[n] != '\0')
+					values[count++] = fields[n];
+			}
+			if(count == 13 && g_ascii_strtoull(values[9], NULL, 10) == s->udp_inode) {
+				*drops = g_ascii_strtoull(values[12], NULL, 10);
+				found = TRUE;
+			}
+			g_strfreev(fields);
+		}
+		fclose(f);
+	}
+	return found;
+}
+
+/* Timer callback to check if the kernel is dropping datagrams on our socket */
+static gboolean whip_udp_report(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->disconnected))
+		return G_SOURCE_REMOVE;
+	guint64 drops = 0;
+	if(!whip_udp_read_drops(s, &drops))
+		return G_SOURCE_CONTINUE;
+	if(drops > s->udp_drops) {
+		WHIP_PREFIX(LOG_WARN, "The kernel dropped %"PRIu64" datagrams on the media socket (%"PRIu64" total): "
+			"consider enlarging the socket buffers\n", drops - s->udp_drops, drops);
+	}
+	s->udp_drops = drops;
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helper method to find the socket the ICE agent uses for media, enlarge
+ * its buffers if needed, and start monitoring the datagrams that are dropped */
+static gboolean whip_udp_setup(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(s->udp_fd > 0 || s->pc == NULL)
+		return G_SOURCE_REMOVE;
+	GSocket *socket = NULL;
+	GstIterator *it = gst_bin_iterate_recurse(GST_BIN(s->pc));
+	GValue item = G_VALUE_INIT;
+	gboolean done = FALSE;
+	while(!done && socket == NULL) {
+		switch(gst_iterator_next(it, &item)) {
+			case GST_ITERATOR_OK: {
+				GstElement *element = g_value_get_object(&item);
+				GstElementFactory *factory = gst_element_get_factory(element);
+				if(factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "nicesink")) {
+					NiceAgent *agent = NULL;
+					guint stream = 0, component = 0;
+					g_object_get(element, "agent", &agent, "stream", &stream, "component", &component, NULL);
+					if(agent != NULL) {
+						socket = nice_agent_get_selected_socket(agent, stream, component);
+						g_object_unref(agent);
+					}
+				}
+				g_value_reset(&item);
+				break;
+			}
+			case GST_ITERATOR_RESYNC:
+				gst_iterator_resync(it);
+				break;
+			default:
+				done = TRUE;
+				break;
+		}
+	}
+	g_value_unset(&item);
+	gst_iterator_free(it);
+	if(socket == NULL) {
+		WHIP_LOG(LOG_VERB, "Couldn't find the media socket, not tuning it\n");
+		return G_SOURCE_REMOVE;
+	}
+	s->udp_fd = g_socket_get_fd(socket);
+	if(s->config.udp_send_buffer > 0)
+		s->udp_sndbuf = whip_udp_set_buffer(s->udp_fd, SO_SNDBUFFORCE, SO_SNDBUF, s->config.udp_send_buffer);
+	if(s->config.udp_recv_buffer > 0)
+		s->udp_rcvbuf = whip_udp_set_buffer(s->udp_fd, SO_RCVBUFFORCE, SO_RCVBUF, s->config.udp_recv_buffer);
+	int size = 0;
+	socklen_t len = sizeof(size);
+	if(s->udp_sndbuf == 0 && getsockopt(s->udp_fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0)
+		s->udp_sndbuf = size / 2;
+	len = sizeof(size);
+	if(s->udp_rcvbuf == 0 && getsockopt(s->udp_fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+		s->udp_rcvbuf = size / 2;
+	WHIP_PREFIX(LOG_INFO, "Media socket buffers: %d bytes (send), %d bytes (receive)\n", s->udp_sndbuf, s->udp_rcvbuf);
+	if((s->config.udp_send_buffer > 0 && s->udp_sndbuf < s->config.udp_send_buffer) ||
+			(s->config.udp_recv_buffer > 0 && s->udp_rcvbuf < s->config.udp_recv_buffer))
+		WHIP_LOG(LOG_WARN, "Socket buffers capped by the system, see net.core.wmem_max and net.core.rmem_max\n");
+	g_object_unref(socket);
+	/* Keep an eye on the datagrams the kernel drops (only works for UDP, of course) */
+	struct stat st;
+	if(fstat(s->udp_fd, &st) == 0) {
+		s->udp_inode = st.st_ino;
+		if(whip_udp_read_drops(s, &s->udp_drops))
+			whip_add_timeout(s, s->config.report_interval * 1000, whip_udp_report);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* DSCP values for audio and video, as per RFC 8837 (high priority) */
+#define WHIP_DSCP_EF	46
+#define WHIP_DSCP_AF41	34
+
+/* Helper method to mark the packets of the ICE stream a nicesink sends on */
+static void whip_dscp_set_tos(whip_session *s, GstElement *nicesink) {
+	NiceAgent *agent = NULL;
+	guint stream = 0;
+	g_object_get(nicesink, "agent", &agent, "stream", &stream, NULL);
+	if(agent == NULL)
+		return;
+	/* The TOS byte has the DSCP in the upper six bits: libnice applies it to
+	 * all the sockets of the stream, including the ones it creates later */
+	nice_agent_set_stream_tos(agent, stream, s->udp_dscp << 2);
+	g_object_unref(agent);
+}
+
+/* Callback invoked for each element in webrtcbin, to find nicesink instances */
+static void whip_dscp_find_element(const GValue *item, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	GstElement *element = g_value_get_object(item);
+	GstElementFactory *factory = gst_element_get_factory(element);
+	if(factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "nicesink"))
+		whip_dscp_set_tos(s, element);
+}
+
+/* Callback invoked when webrtcbin creates new elements (e.g., transports,
+ * which are added as bins that contain their nicesink already) */
+static void whip_dscp_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(GST_IS_BIN(element)) {
+		GstIterator *it = gst_bin_iterate_recurse(GST_BIN(element));
+		while(gst_iterator_foreach(it, whip_dscp_find_element, s) == GST_ITERATOR_RESYNC)
+			gst_iterator_resync(it);
+		gst_iterator_free(it);
+		return;
+	}
+	GValue item = G_VALUE_INIT;
+	g_value_init(&item, GST_TYPE_ELEMENT);
+	g_value_set_object(&item, element);
+	whip_dscp_find_element(&item, s);
+	g_value_unset(&item);
+}
+
+/* Helper method to mark the packets we send with the right DSCP: since we
+ * bundle, audio and video share the transport, and so they can only be
+ * marked the same way; we use EF when we only send audio, and AF41
+ * otherwise, as marking video as EF would make it compete with voice
+ * traffic. We set the TOS on the ICE streams as soon as they're created,
+ * so that connectivity checks and DTLS are marked too, whatever the
+ * transport (UDP, TCP or TURN) that ends up being used. We don't set
+ * a priority on the senders, as webrtcbin would then set a TOS itself */
+static void whip_dscp_setup(whip_session *s) {
+	gboolean video = FALSE;
+#if GST_CHECK_VERSION(1, 20, 0)
+	GArray *transceivers = NULL;
+	g_signal_emit_by_name(s->pc, "get-transceivers", &transceivers);
+	if(transceivers != NULL) {
+		guint i = 0;
+		for(i = 0; i < transceivers->len; i++) {
+			GstWebRTCRTPTransceiver *transceiver = g_array_index(transceivers, GstWebRTCRTPTransceiver *, i);
+			GstWebRTCKind kind = GST_WEBRTC_KIND_UNKNOWN;
+			g_object_get(transceiver, "kind", &kind, NULL);
+			if(kind == GST_WEBRTC_KIND_VIDEO)
+				video = TRUE;
+		}
+		g_array_unref(transceivers);
+	}
+#else
+	video = (s->config.video_pipe != NULL || s->auto_video_pipe != NULL);
+#endif
+	s->udp_dscp = (video ? WHIP_DSCP_AF41 : WHIP_DSCP_EF);
+	/* Transports may have been created already */
+	GstIterator *it = gst_bin_iterate_recurse(GST_BIN(s->pc));
+	while(gst_iterator_foreach(it, whip_dscp_find_element, s) == GST_ITERATOR_RESYNC)
+		gst_iterator_resync(it);
+	gst_iterator_free(it);
+	g_signal_connect(s->pc, "deep-element-added", G_CALLBACK(whip_dscp_element_added), s);
+	WHIP_PREFIX(LOG_INFO, "Marking packets as %s (DSCP %d)\n",
+		(video ? "AF41" : "EF"), s->udp_dscp);
+}
+
+/* How often to check the loss reported by the receiver, to tune Opus */
+#define WHIP_OPUS_INTERVAL	2000
+
+/* Helper method to find the Opus encoder in our pipeline */
+static gint whip_opus_find(gconstpointer a, gconstpointer b) {
+	GstElement *element = g_value_get_object((const GValue *)a);
+	GstElementFactory *factory = gst_element_get_factory(element);
+	return (factory != NULL && !strcmp(GST_OBJECT_NAME(factory), "opusenc")) ? 0 : 1;
+}
+
+/* Helper method to configure the Opus encoder according to the audio profile:
+ * both profiles use in-band FEC and the configured frame size, while the
+ * voice profile also tunes the encoder for speech and enables DTX */
+static void whip_opus_setup(whip_session *s) {
+	if(s->bin == NULL)
+		return;
+	GstIterator *it = gst_bin_iterate_recurse(s->bin);
+	GValue item = G_VALUE_INIT;
+	if(gst_iterator_find_custom(it, whip_opus_find, &item, NULL)) {
+		s->opusenc = gst_object_ref(g_value_get_object(&item));
+		g_value_unset(&item);
+	}
+	gst_iterator_free(it);
+	if(s->opusenc == NULL) {
+		WHIP_LOG(LOG_WARN, "No opusenc in the pipeline, ignoring the audio profile\n");
+		return;
+	}
+	gboolean voice = !strcasecmp(s->config.audio_profile, "voice");
+	char frame_size[8];
+	g_snprintf(frame_size, sizeof(frame_size), "%d", s->config.audio_ptime);
+	gst_util_set_object_arg(G_OBJECT(s->opusenc), "frame-size", frame_size);
+	gst_util_set_object_arg(G_OBJECT(s->opusenc), "audio-type", voice ? "voice" : "generic");
+	/* Until we get RTCP feedback, we assume some loss, or FEC won't kick in */
+	s->opus_loss_pct = 5;
+	g_object_set(s->opusenc, "inband-fec", TRUE, "dtx", voice,
+		"packet-loss-percentage", s->opus_loss_pct, NULL);
+	WHIP_PREFIX(LOG_INFO, "Configured '%s' for %s (FEC, %sDTX, %dms frames)\n",
+		GST_OBJECT_NAME(s->opusenc), s->config.audio_profile, voice ? "" : "no ", s->config.audio_ptime);
+	whip_add_timeout(s, WHIP_OPUS_INTERVAL, whip_opus_update);
+}
+
+/* Helper method to add the Opus parameters we use to the SDP offer */
+static void whip_opus_munge_sdp(whip_session *s, GstSDPMessage *sdp) {
+	gboolean voice = !strcasecmp(s->config.audio_profile, "voice");
+	guint i = 0, j = 0;
+	for(i = 0; i < gst_sdp_message_medias_len(sdp); i++) {
+		GstSDPMedia *media = (GstSDPMedia *)gst_sdp_message_get_media(sdp, i);
+		if(strcmp(gst_sdp_media_get_media(media), "audio"))
+			continue;
+		/* Find the payload type Opus is using */
+		int pt = -1;
+		for(j = 0; j < gst_sdp_media_attributes_len(media); j++) {
+			const GstSDPAttribute *attr = gst_sdp_media_get_attribute(media, j);
+			if(!strcmp(attr->key, "rtpmap") && attr->value != NULL) {
+				char *rtpmap = g_ascii_strdown(attr->value, -1);
+				if(strstr(rtpmap, " opus/48000") != NULL)
+					pt = atoi(rtpmap);
+				g_free(rtpmap);
+				if(pt >= 0)
+					break;
+			}
+		}
+		if(pt < 0)
+			continue;
+		/* Update the fmtp attribute, or add it if it's not there */
+		char prefix[8], fmtp[256];
+		g_snprintf(prefix, sizeof(prefix), "%d ", pt);
+		const GstSDPAttribute *old = NULL;
+		for(j = 0; j < gst_sdp_media_attributes_len(media); j++) {
+			const GstSDPAttribute *attr = gst_sdp_media_get_attribute(media, j);
+			if(!strcmp(attr->key, "fmtp") && attr->value != NULL && g_str_has_prefix(attr->value, prefix)) {
+				old = attr;
+				break;
+			}
+		}
+		GString *params = g_string_new(old ? old->value + strlen(prefix) : "");
+		if(strstr(params->str, "useinbandfec=") == NULL)
+			g_string_append_printf(params, "%suseinbandfec=1", params->len ? ";" : "");
+		if(voice && strstr(params->str, "usedtx=") == NULL)
+			g_string_append_printf(params, "%susedtx=1", params->len ? ";" : "");
+		g_snprintf(fmtp, sizeof(fmtp), "%d %s", pt, params->str);
+		g_string_free(params, TRUE);
+		if(old != NULL) {
+			/* The media takes ownership of the new attribute */
+			GstSDPAttribute attr;
+			gst_sdp_attribute_set(&attr, "fmtp", fmtp);
+			gst_sdp_media_replace_attribute(media, j, &attr);
+		} else {
+			gst_sdp_media_add_attribute(media, "fmtp", fmtp);
+		}
+		/* Signal the packetization time we're using too */
+		if(gst_sdp_media_get_attribute_val(media, "ptime") == NULL) {
+			char ptime[8];
+			g_snprintf(ptime, sizeof(ptime), "%d", s->config.audio_ptime);
+			gst_sdp_media_add_attribute(media, "ptime", ptime);
+		}
+		WHIP_PREFIX(LOG_VERB, "Opus parameters in the offer: %s, ptime %d\n", fmtp, s->config.audio_ptime);
+	}
+}
+
+/* Callback invoked for each stats entry, to find the loss the receiver
+ * reported for the media we send with a specific clock rate */
+static gboolean whip_remote_loss_find(GQuark field_id, const GValue *value, gpointer user_data) {
+	const GstStructure *stats = NULL;
+	if(!GST_VALUE_HOLDS_STRUCTURE(value) || (stats = gst_value_get_structure(value)) == NULL)
+		return TRUE;
+	GstWebRTCStatsType type = 0;
+	if(!gst_structure_get(stats, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL) ||
+			type != GST_WEBRTC_STATS_REMOTE_INBOUND_RTP)
+		return TRUE;
+	gpointer *data = (gpointer *)user_data;
+	const GstStructure *reply = data[0];
+	const char *codec_id = gst_structure_get_string(stats, "codec-id");
+	const GValue *codec_value = codec_id ? gst_structure_get_value(reply, codec_id) : NULL;
+	guint clock_rate = 0;
+	if(codec_value == NULL || !GST_VALUE_HOLDS_STRUCTURE(codec_value) ||
+			!gst_structure_get_uint(gst_value_get_structure(codec_value), "clock-rate", &clock_rate) ||
+			clock_rate != GPOINTER_TO_UINT(data[2]))
+		return TRUE;
+	if(gst_structure_get_double(stats, "fraction-lost", (double *)data[1]))
+		return FALSE;
+	return TRUE;
+}
+
+/* Helper method to get the loss the receiver reported via RTCP for our
+ * audio (48000) or video (90000), as a fraction between 0 and 1 */
+static gboolean whip_remote_loss(whip_session *s, guint clock_rate, double *loss) {
+	/* If we failed over, check the PeerConnection we're publishing on now */
+	if(s->backup != NULL && s->backup_active)
+		s = s->backup;
+	if(s->pc == NULL || s->public_state != WHIP_SESSION_CONNECTED)
+		return FALSE;
+	GstPromise *promise = gst_promise_new();
+	g_signal_emit_by_name(s->pc, "get-stats", NULL, promise);
+	if(gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED) {
+		gst_promise_unref(promise);
+		return FALSE;
+	}
+	const GstStructure *reply = gst_promise_get_reply(promise);
+	*loss = -1;
+	gpointer data[3] = { (gpointer)reply, loss, GUINT_TO_POINTER(clock_rate) };
+	gst_structure_foreach(reply, whip_remote_loss_find, data);
+	gst_promise_unref(promise);
+	return (*loss >= 0);
+}
+
+/* Timer callback to tune the expected packet loss of the Opus encoder,
+ * according to what the receiver reported via RTCP: this makes the
+ * encoder spend more (or fewer) bits on FEC, depending on the network */
+static gboolean whip_opus_update(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->disconnected) || s->opusenc == NULL)
+		return G_SOURCE_REMOVE;
+	double loss = 0;
+	if(!whip_remote_loss(s, 48000, &loss))
+		return G_SOURCE_CONTINUE;
+	/* Smooth the loss, react faster when it increases than when it decreases */
+	s->opus_loss += (loss - s->opus_loss) * (loss > s->opus_loss ? 0.5 : 0.1);
+	/* Never go below a minimal amount of expected loss, nor above what FEC can help with */
+	int pct = (int)(s->opus_loss * 100 + 0.5);
+	pct = CLAMP(pct, 1, 30);
+	if(pct != s->opus_loss_pct) {
+		WHIP_PREFIX(LOG_VERB, "Receiver loss %.1f%%, updating the Opus expected packet loss to %d%%\n",
+			loss * 100, pct);
+		s->opus_loss_pct = pct;
+		g_object_set(s->opusenc, "packet-loss-percentage", pct, NULL);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+/* Pad probe on the pacing queue sink pad: we take note of when packets arrive */
+static GstPadProbeReturn whip_pacer_in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_pacer *pacer = (whip_pacer *)user_data;
+	g_mutex_lock(&pacer->mutex);
+	if(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_FLUSH) {
+		/* The queue is being flushed, forget about the packets in it */
+		if(GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_FLUSH_STOP) {
+			while(!g_queue_is_empty(&pacer->arrivals))
+				g_free(g_queue_pop_head(&pacer->arrivals));
+		}
+	} else {
+		gint64 now = g_get_monotonic_time();
+		gint64 *arrival = g_malloc(sizeof(gint64));
+		*arrival = now;
+		g_queue_push_tail(&pacer->arrivals, arrival);
+		/* Measure the input bitrate every second, and pace relative to it
+		 * (and never below the configured bitrate, if we know it) */
+		if(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+			pacer->in_bytes += gst_buffer_list_calculate_size(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+		else
+			pacer->in_bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+		if(pacer->in_start == 0) {
+			pacer->in_start = now;
+		} else if(now - pacer->in_start >= G_USEC_PER_SEC) {
+			gint64 measured = pacer->in_bytes * G_USEC_PER_SEC / (now - pacer->in_start);
+			pacer->input = (pacer->input == 0 ? measured : (pacer->input * 7 + measured * 3) / 10);
+			pacer->rate = MAX((gint64)(MAX(pacer->input, pacer->target) * pacer->factor), 1);
+			/* Allow bursts of 5ms worth of data, and never less than a couple of packets */
+			pacer->burst = MAX(pacer->rate / 200, 3000);
+			pacer->in_bytes = 0;
+			pacer->in_start = now;
+		}
+	}
+	g_mutex_unlock(&pacer->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Pad probe on the pacing queue src pad: we only let packets through when
+ * there are enough tokens, blocking the queue thread otherwise */
+static GstPadProbeReturn whip_pacer_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_pacer *pacer = (whip_pacer *)user_data;
+	gint64 size = 0;
+	if(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+		size = gst_buffer_list_calculate_size(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+	else
+		size = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+	g_mutex_lock(&pacer->mutex);
+	gint64 *arrival = g_queue_pop_head(&pacer->arrivals);
+	gint64 now = g_get_monotonic_time();
+	pacer->tokens = MIN(pacer->burst, pacer->tokens + (now - pacer->last) * pacer->rate / G_USEC_PER_SEC);
+	pacer->last = now;
+	gint64 wait = 0;
+	if(pacer->rate > 0 && pacer->tokens < size)
+		wait = (size - pacer->tokens) * G_USEC_PER_SEC / pacer->rate;
+	/* We may go in debt, the refill will take care of it */
+	pacer->tokens -= size;
+	g_mutex_unlock(&pacer->mutex);
+	/* Don't stall the branch for too long, whatever happens */
+	if(wait > 0) {
+		g_usleep(MIN(wait, 100000));
+		now = g_get_monotonic_time();
+	}
+	/* The delay is what the packet actually waited, queue and sleep included */
+	guint64 delay = arrival ? (now - *arrival) : (guint64)MIN(wait, 100000);
+	g_free(arrival);
+	g_mutex_lock(&pacer->mutex);
+	pacer->packets++;
+	pacer->total += delay;
+	if(delay > pacer->max)
+		pacer->max = delay;
+	g_mutex_unlock(&pacer->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Helper method to set up the pacer on the video branch */
+static void whip_pacer_setup(whip_session *s) {
+	GstElement *queue = gst_bin_get_by_name(s->bin, "whip_video_pacer");
+	if(queue == NULL) {
+		WHIP_LOG(LOG_WARN, "No video branch to pace\n");
+		return;
+	}
+	whip_pacer *pacer = g_malloc0(sizeof(whip_pacer));
+	pacer->factor = s->config.pacing_factor;
+	/* We only know the bitrate if we picked the encoder ourselves: in that case
+	 * we start pacing right away, otherwise we wait until we measured it */
+	if(s->config.video_codec != NULL && s->config.video_bitrate > 0) {
+		pacer->target = (gint64)s->config.video_bitrate * 1000 / 8;
+		pacer->rate = MAX((gint64)(pacer->target * pacer->factor), 1);
+	}
+	pacer->burst = MAX(pacer->rate / 200, 3000);
+	pacer->tokens = pacer->burst;
+	pacer->last = g_get_monotonic_time();
+	g_queue_init(&pacer->arrivals);
+	g_mutex_init(&pacer->mutex);
+	s->pacer = pacer;
+	GstPad *pad = gst_element_get_static_pad(queue, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+		whip_pacer_in_probe, pacer, NULL);
+	gst_object_unref(pad);
+	pad = gst_element_get_static_pad(queue, "src");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+		whip_pacer_out_probe, pacer, NULL);
+	gst_object_unref(pad);
+	gst_object_unref(queue);
+	if(pacer->rate > 0) {
+		WHIP_PREFIX(LOG_INFO, "Pacing video at %"G_GINT64_FORMAT" kbps (%.2fx the target bitrate), at least\n",
+			pacer->rate * 8 / 1000, pacer->factor);
+	} else {
+		WHIP_PREFIX(LOG_INFO, "Pacing video at %.2fx the measured bitrate (not pacing until measured)\n",
+			pacer->factor);
+	}
+	whip_add_timeout(s, s->config.report_interval * 1000, whip_pacer_report);
+}
+
+/* Timer callback to print the pacing queue delay */
+static gboolean whip_pacer_report(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(s->pacer == NULL || g_atomic_int_get(&s->disconnected))
+		return FALSE;
+	whip_pacer *pacer = s->pacer;
+	g_mutex_lock(&pacer->mutex);
+	if(pacer->packets == 0) {
+		WHIP_PREFIX(LOG_INFO, "Pacing report (last %ds): no packets\n", s->config.report_interval);
+	} else {
+		WHIP_PREFIX(LOG_INFO, "Pacing report (last %ds): queue delay avg %.2fms, max %.2fms (%"PRIu64" packets)\n",
+			s->config.report_interval, (double)pacer->total / pacer->packets / 1000,
+			(double)pacer->max / 1000, pacer->packets);
+	}
+	pacer->packets = 0;
+	pacer->total = 0;
+	pacer->max = 0;
+	g_mutex_unlock(&pacer->mutex);
+	return TRUE;
+}
+
+static void whip_pacer_free(whip_pacer *pacer) {
+	if(pacer == NULL)
+		return;
+	while(!g_queue_is_empty(&pacer->arrivals))
+		g_free(g_queue_pop_head(&pacer->arrivals));
+	g_mutex_clear(&pacer->mutex);
+	g_free(pacer);
+}
+
+/* Levels of video degradation, as percentages of the source resolution and
+ * framerate, for each preference (balanced, maintain-framerate/resolution) */
+typedef struct whip_degradation_level {
+	int scale, rate;
+} whip_degradation_level;
+static const whip_degradation_level whip_degradation_balanced[] = {
+	{ 100, 100 }, { 75, 100 }, { 75, 66 }, { 50, 66 }, { 50, 50 }, { 25, 50 }
+};
+static const whip_degradation_level whip_degradation_framerate[] = {
+	{ 100, 100 }, { 75, 100 }, { 50, 100 }, { 37, 100 }, { 25, 100 }
+};
+static const whip_degradation_level whip_degradation_resolution[] = {
+	{ 100, 100 }, { 100, 66 }, { 100, 50 }, { 100, 33 }, { 100, 25 }
+};
+
+/* How often we check whether we should move to a different level, what we
+ * consider overuse (encoder busy more than 85% of the time, or loss above
+ * 10%) and underuse (encoder busy less than 50%, and loss below 2%), and
+ * how many consecutive checks and how much time we need before switching */
+#define WHIP_DEGRADATION_INTERVAL		1000
+#define WHIP_DEGRADATION_USAGE_HIGH		0.85
+#define WHIP_DEGRADATION_USAGE_LOW		0.50
+#define WHIP_DEGRADATION_LOSS_HIGH		0.10
+#define WHIP_DEGRADATION_LOSS_LOW		0.02
+#define WHIP_DEGRADATION_DOWN_CHECKS	3
+#define WHIP_DEGRADATION_UP_CHECKS		10
+#define WHIP_DEGRADATION_UP_DELAY		(10 * G_USEC_PER_SEC)
+
+/* Encoder frame we're waiting for */
+typedef struct whip_degradation_frame {
+	GstClockTime pts;
+	gint64 in;
+} whip_degradation_frame;
+
+/* Pad probe on the video encoder sink pad: we take note of when frames get in */
+static GstPadProbeReturn whip_degradation_in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_degradation *d = (whip_degradation *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(buffer == NULL || !GST_BUFFER_PTS_IS_VALID(buffer))
+		return GST_PAD_PROBE_OK;
+	whip_degradation_frame *frame = g_malloc(sizeof(whip_degradation_frame));
+	frame->pts = GST_BUFFER_PTS(buffer);
+	frame->in = g_get_monotonic_time();
+	g_mutex_lock(&d->mutex);
+	g_queue_push_tail(&d->frames, frame);
+	/* Don't grow forever if the encoder drops frames */
+	while(g_queue_get_length(&d->frames) > 100)
+		g_free(g_queue_pop_head(&d->frames));
+	g_mutex_unlock(&d->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Pad probe on the video encoder src pad: we measure how long encoding took */
+static GstPadProbeReturn whip_degradation_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	whip_degradation *d = (whip_degradation *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(buffer == NULL || !GST_BUFFER_PTS_IS_VALID(buffer))
+		return GST_PAD_PROBE_OK;
+	gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&d->mutex);
+	/* Frames that the encoder dropped are skipped */
+	whip_degradation_frame *frame = NULL;
+	while((frame = g_queue_peek_head(&d->frames)) != NULL && frame->pts <= GST_BUFFER_PTS(buffer)) {
+		g_queue_pop_head(&d->frames);
+		if(frame->pts == GST_BUFFER_PTS(buffer)) {
+			/* Only count time the encoder wasn't already busy with another frame */
+			d->busy += now - MAX(frame->in, d->since);
+			d->since = now;
+		}
+		g_free(frame);
+	}
+	g_mutex_unlock(&d->mutex);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Callback invoked for each element in the pipeline, to find the video encoder */
+static void whip_degradation_find_encoder(const GValue *item, gpointer user_data) {
+	GstElement **encoder = (GstElement **)user_data;
+	GstElement *element = g_value_get_object(item);
+	if(*encoder == NULL && whip_element_has_klass(element, "Encoder") && whip_element_has_klass(element, "Video"))
+		*encoder = gst_object_ref(element);
+}
+
+/* Helper method to set up the degradation controller */
+static void whip_degradation_setup(whip_session *s) {
+	GstElement *scaler = gst_bin_get_by_name(s->bin, "whip_video_scaler");
+	GstElement *capsfilter = gst_bin_get_by_name(s->bin, "whip_video_degrader");
+	GstElement *encoder = NULL;
+	whip_foreach_element(s->bin, (GstIteratorForeachFunction)whip_degradation_find_encoder, &encoder);
+	if(scaler == NULL || capsfilter == NULL || encoder == NULL) {
+		WHIP_LOG(LOG_WARN, "No video branch to degrade\n");
+		if(scaler != NULL)
+			gst_object_unref(scaler);
+		if(capsfilter != NULL)
+			gst_object_unref(capsfilter);
+		if(encoder != NULL)
+			gst_object_unref(encoder);
+		return;
+	}
+	whip_degradation *d = g_malloc0(sizeof(whip_degradation));
+	if(!strcasecmp(s->config.degradation, "maintain-framerate")) {
+		d->ladder = whip_degradation_framerate;
+		d->levels = G_N_ELEMENTS(whip_degradation_framerate);
+	} else if(!strcasecmp(s->config.degradation, "maintain-resolution")) {
+		d->ladder = whip_degradation_resolution;
+		d->levels = G_N_ELEMENTS(whip_degradation_resolution);
+	} else {
+		d->ladder = whip_degradation_balanced;
+		d->levels = G_N_ELEMENTS(whip_degradation_balanced);
+	}
+	d->scaler = scaler;
+	d->capsfilter = capsfilter;
+	d->since = g_get_monotonic_time();
+	d->last_switch = d->since;
+	g_queue_init(&d->frames);
+	g_mutex_init(&d->mutex);
+	s->degradation = d;
+	GstPad *pad = gst_element_get_static_pad(encoder, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, whip_degradation_in_probe, d, NULL);
+	gst_object_unref(pad);
+	pad = gst_element_get_static_pad(encoder, "src");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, whip_degradation_out_probe, d, NULL);
+	gst_object_unref(pad);
+	WHIP_PREFIX(LOG_INFO, "Degrading video when needed (%s, monitoring '%s')\n",
+		s->config.degradation, GST_OBJECT_NAME(encoder));
+	gst_object_unref(encoder);
+	whip_add_timeout(s, WHIP_DEGRADATION_INTERVAL, whip_degradation_update);
+}
+
+/* Helper method to constrain the raw video according to the current level */
+static void whip_degradation_apply(whip_session *s) {
+	whip_degradation *d = s->degradation;
+	const whip_degradation_level *level = &d->ladder[d->level];
+	if(d->level == 0) {
+		/* Back to the source caps */
+		GstCaps *caps = gst_caps_new_any();
+		g_object_set(d->capsfilter, "caps", caps, NULL);
+		gst_caps_unref(caps);
+		WHIP_PREFIX(LOG_INFO, "Video back to full resolution and framerate\n");
+		return;
+	}
+	/* Check what the source is producing */
+	GstPad *pad = gst_element_get_static_pad(d->scaler, "sink");
+	GstCaps *source = gst_pad_get_current_caps(pad);
+	gst_object_unref(pad);
+	GstVideoInfo info;
+	if(source == NULL || !gst_video_info_from_caps(&info, source)) {
+		if(source != NULL)
+			gst_caps_unref(source);
+		return;
+	}
+	gst_caps_unref(source);
+	/* Keep sizes even, as most encoders need that */
+	int width = MAX(2, (GST_VIDEO_INFO_WIDTH(&info) * level->scale / 100) & ~1);
+	int height = MAX(2, (GST_VIDEO_INFO_HEIGHT(&info) * level->scale / 100) & ~1);
+	GstCaps *caps = gst_caps_new_simple("video/x-raw",
+		"width", G_TYPE_INT, width, "height", G_TYPE_INT, height,
+		"pixel-aspect-ratio", GST_TYPE_FRACTION, GST_VIDEO_INFO_PAR_N(&info), GST_VIDEO_INFO_PAR_D(&info), NULL);
+	int fps_n = GST_VIDEO_INFO_FPS_N(&info), fps_d = GST_VIDEO_INFO_FPS_D(&info);
+	if(fps_n > 0 && level->rate < 100) {
+		/* Only constrain the framerate if the source has a fixed one */
+		gst_util_fraction_multiply(fps_n, fps_d, level->rate, 100, &fps_n, &fps_d);
+		gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION, fps_n, fps_d, NULL);
+	}
+	g_object_set(d->capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	WHIP_PREFIX(LOG_INFO, "Video degradation level %d: %dx%d@%.2f (encode usage %.0f%%, loss %.1f%%)\n",
+		d->level, width, height, fps_d > 0 ? (double)fps_n / fps_d : 0.0, d->usage * 100, d->loss * 100);
+}
+
+/* Timer callback to check if we should degrade the video, or restore it */
+static gboolean whip_degradation_update(gpointer user_data) {
+	whip_session *s = (whip_session *)user_data;
+	if(g_atomic_int_get(&s->disconnected) || s->degradation == NULL)
+		return G_SOURCE_REMOVE;
+	whip_degradation *d = s->degradation;
+	gint64 now = g_get_monotonic_time();
+	double loss = 0;
+	gboolean has_loss = whip_remote_loss(s, 90000, &loss);
+	g_mutex_lock(&d->mutex);
+	/* How much of the time since the last check the encoder was busy */
+	gint64 elapsed = now - d->last_switch;
+	d->usage = (double)d->busy / (WHIP_DEGRADATION_INTERVAL * 1000);
+	d->busy = 0;
+	/* Smooth the loss, react faster when it increases than when it decreases */
+	if(has_loss)
+		d->loss += (loss - d->loss) * (loss > d->loss ? 0.5 : 0.1);
+	gboolean overuse = (d->usage > WHIP_DEGRADATION_USAGE_HIGH || d->loss > WHIP_DEGRADATION_LOSS_HIGH);
+	gboolean underuse = (d->usage < WHIP_DEGRADATION_USAGE_LOW && d->loss < WHIP_DEGRADATION_LOSS_LOW);
+	d->overuse = (overuse ? d->overuse + 1 : 0);
+	d->underuse = (underuse ? d->underuse + 1 : 0);
+	int level = d->level;
+	if(d->overuse >= WHIP_DEGRADATION_DOWN_CHECKS && d->level < d->levels - 1) {
+		level = d->level + 1;
+	} else if(d->underuse >= WHIP_DEGRADATION_UP_CHECKS && d->level > 0 &&
+			elapsed >= WHIP_DEGRADATION_UP_DELAY) {
+		level = d->level - 1;
+	}
+	gboolean changed = (level != d->level);
+	if(changed) {
+		d->level = level;
+		d->overuse = 0;
+		d->underuse = 0;
+		d->last_switch = now;
+	}
+	g_mutex_unlock(&d->mutex);
+	if(changed)
+		whip_degradation_apply(s);
+	return G_SOURCE_CONTINUE;
+}
+
+static void whip_degradation_free(whip_degradation *d) {
+	if(d == NULL)
+		return;
+	while(!g_queue_is_empty(&d->frames))
+		g_free(g_queue_pop_head(&d->frames));
+	gst_object_unref(d->scaler);
+	gst_object_unref(d->capsfilter);
+	g_mutex_clear(&d->mutex);
+	g_free(d);
+}
@@ -0,0 +1,216 @@
+/*
+ * Simple WHIP client
+ *
+ * Author:  Lorenzo Miniero <lorenzo@meetecho.com>
+ * License: GPLv3
+ *
+ * Public API of libwhip, the library implementing the WHIP logic: it
+ * can be used to publish a GStreamer pipeline to a WHIP endpoint from
+ * within an application, rather than spawning a whip-client process.
+ *
+ * The library uses the GLib main context that is the thread-default one
+ * when a session is created, so a GMainLoop must be running on it. All
+ * the methods, except whip_session_stop(), whip_session_shutdown() and
+ * whip_session_get_stats(),
+ * must be called from the thread owning that context; callbacks may be
+ * invoked from GStreamer threads as well.
+ *
+ */
+
+#ifndef WHIP_H
+#define WHIP_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+/* Version of the API: incremented any time the API changes */
+#define WHIP_API_VERSION	4
+
+/* Public state of a WHIP session */
+typedef enum whip_session_state {
+	/* Session created, but not started yet */
+	WHIP_SESSION_IDLE = 0,
+	/* Offer sent to the WHIP endpoint, waiting for the PeerConnection */
+	WHIP_SESSION_CONNECTING,
+	/* PeerConnection up, we're publishing */
+	WHIP_SESSION_CONNECTED,
+	/* Session torn down, either because of an error or a stop */
+	WHIP_SESSION_DISCONNECTED,
+	/* Standby: offer and candidates ready, waiting for whip_session_publish() */
+	WHIP_SESSION_READY
+} whip_session_state;
+
+/* Configuration of a WHIP session: always allocate it with whip_config_new(),
+ * as new fields may be added at the end in future versions of the library.
+ * Strings and arrays are not copied, and so must be kept valid as long as
+ * any session created with this configuration exists */
+typedef struct whip_config {
+	/* Address of the WHIP endpoint (required) */
+	const char *url;
+	/* Authentication Bearer token to use, if any */
+	const char *token;
+	/* Partial GStreamer pipelines to use for audio and video, if the
+	 * library should create the pipeline (see whip_session_attach()) */
+	const char *audio_pipe, *video_pipe;
+	/* Whether to put candidates in the SDP offer, rather than trickling them */
+	gboolean no_trickle;
+	/* Whether to use the Link headers to configure STUN/TURN servers */
+	gboolean follow_link;
+	/* STUN server (stun://hostname:port) and NULL-terminated list of TURN
+	 * servers (turn(s)://username:password@host:port?transport=[udp,tcp]) */
+	const char *stun_server, **turn_server;
+	/* Whether to force the usage of a TURN relay */
+	gboolean force_turn;
+	/* Jitter buffer (latency) to use in RTP, in milliseconds (-1 to use the default) */
+	int latency;
+	/* GStreamer sink name to monitor for an EOS, if any */
+	const char *eos_sink_name;
+	/* HTTP debugging level (none, minimal, headers, body) */
+	const char *http_debugging;
+	/* Whether to stamp capture times and measure the latency (see README) */
+	gboolean latency_probe;
+	/* Whether to profile the elements in the pipeline, and how many to report */
+	gboolean profile;
+	int profile_top;
+	/* How often to print periodic reports, in seconds */
+	int report_interval;
+	/* Video codec to automatically pick an encoder for, if any (vp8, vp9,
+	 * h264, av1), and the profile to tune it for (low-latency, quality,
+	 * low-cpu), plus bitrate (kbps), keyframe interval (frames) and threads */
+	const char *video_codec, *encoder_profile;
+	int video_bitrate, keyframe_interval, encoder_threads;
+	/* CPU cores to pin encoding and network streaming threads to (e.g., 0-3,6) */
+	const char *encode_cpus, *network_cpus;
+	/* Whether to try and avoid copies in the raw video branch */
+	gboolean zero_copy;
+	/* Path to a PEM file with the DTLS certificate and key to use: if the
+	 * file doesn't exist, the certificate we generate is saved there */
+	const char *dtls_pem;
+	/* Whether to prepare everything (pipeline, offer, candidates) in advance,
+	 * and only send the offer when whip_session_publish() is called */
+	gboolean standby;
+	/* NULL-terminated list of backup WHIP endpoints to fail over to, in order,
+	 * when publishing to the current one fails; if hot_standby is set, a
+	 * session to the next backup is negotiated in advance (without media),
+	 * so that switching to it only takes a few hundred milliseconds */
+	const char **backup_urls;
+	gboolean hot_standby;
+	/* NULL-terminated list of alternative WHIP endpoints (e.g., regional
+	 * URLs) to race url against: an OPTIONS is sent to all of them in
+	 * parallel, and the first one that responds successfully (2xx, or 405
+	 * if OPTIONS is not implemented) is the one we publish to */
+	const char **race_urls;
+	/* Path to a file where to cache the STUN/TURN servers we get via Link
+	 * headers (follow_link), per endpoint, so that restarts within the TTL
+	 * (in seconds) don't need an OPTIONS; TURN credentials following the
+	 * TURN REST API (timestamp:username) are never used after they expire */
+	const char *ice_cache;
+	int ice_cache_ttl;
+	/* Whether to stick to HTTP/1.1, rather than letting libsoup negotiate HTTP/2 */
+	gboolean force_http1;
+	/* Log level (as in whip_log_level) to print the timing of each HTTP
+	 * request at (DNS, connect, TLS, server wait, transfer), which is also
+	 * aggregated per method in the session stats */
+	int http_timing_log_level;
+	/* How long stopping a session can take at most, in milliseconds (0 means
+	 * no limit): with whip_session_stop() this bounds the DELETE, while with
+	 * whip_session_shutdown() it bounds flushing the encoders too */
+	int teardown_timeout;
+	/* ICE candidate filters: interfaces to gather candidates on, or not, as
+	 * comma-separated lists of names (wildcards allowed, e.g., docker*,veth*),
+	 * IP family to use (ipv4, ipv6, or NULL for both), whether to disable TCP
+	 * and mDNS candidates, and how many candidates of each type (host, srflx,
+	 * prflx, relay) to signal at most (0 means no limit); interfaces, family
+	 * and TCP are enforced on the ICE agent, which needs GStreamer >= 1.22 */
+	const char *ice_interfaces, *ice_exclude_interfaces, *ice_family;
+	gboolean ice_no_tcp, ice_no_mdns;
+	int ice_max_candidates;
+	/* Port range the ICE agent should use (0 to use the defaults; needs
+	 * GStreamer >= 1.22), and size of the kernel send and receive buffers of
+	 * the media socket, in bytes (0 to leave the system defaults) */
+	int ice_min_port, ice_max_port;
+	int udp_send_buffer, udp_recv_buffer;
+	/* If higher than 0, video packets are paced at this multiple of the
+	 * video bitrate (e.g., 2.5, and never less than 1), to avoid sending keyframes as one burst:
+	 * the bitrate is measured on the video branch (and never assumed lower
+	 * than video_bitrate, when video_codec is set); only works if the
+	 * library creates the pipeline */
+	double pacing_factor;
+	/* Whether to mark the media we send with DSCP values (EF for audio, AF41
+	 * for video): as audio and video are bundled on the same socket, when
+	 * video is sent both are marked as AF41 */
+	gboolean dscp;
+	/* Audio profile to tune opusenc for (voice, music), if any, and the frame
+	 * size (ptime) to use, in milliseconds (10, 20, 40, 60): both profiles
+	 * enable in-band FEC, with the expected packet loss updated according to
+	 * RTCP feedback, while the voice profile enables DTX as well */
+	const char *audio_profile;
+	int audio_ptime;
+	/* How to degrade the video when the encoder can't keep up, or the receiver
+	 * reports too much loss (balanced, maintain-framerate, maintain-resolution),
+	 * if at all: the raw video is scaled down (and back up when things get
+	 * better) without renegotiating; only works with video_codec */
+	const char *degradation;
+} whip_config;
+
+/* Opaque WHIP session */
+typedef struct whip_session whip_session;
+
+/* Callbacks the application can be notified on */
+typedef struct whip_callbacks {
+	/* The state of the session changed */
+	void (*state_changed)(whip_session *session, whip_session_state state, gpointer user_data);
+	/* The session was torn down (reason is a human readable string) */
+	void (*disconnected)(whip_session *session, const char *reason, gpointer user_data);
+} whip_callbacks;
+
+/* Configuration management */
+whip_config *whip_config_new(void);
+void whip_config_free(whip_config *config);
+
+/* Check if GStreamer has all the plugins we need (gst_init must have been called) */
+gboolean whip_check_plugins(void);
+
+/* Process-wide DNS cache: this replaces the default GResolver of the whole
+ * process (and so affects all lookups, not only the library's) with one that
+ * caches results for ttl seconds, and makes sessions resolve the WHIP and
+ * STUN/TURN hosts in parallel as soon as they're started; only call it if
+ * the process is yours (e.g., not from a plugin), before creating sessions.
+ * Disabling the cache restores the resolver that was the default before */
+void whip_dns_cache_enable(int ttl);
+void whip_dns_cache_disable(void);
+
+/* Create a new session: by default, the session creates its own pipeline
+ * out of the audio/video pipelines in the configuration; the configuration
+ * structure is copied, but see whip_config for the strings it contains */
+whip_session *whip_session_new(const whip_config *config);
+/* Attach the session to an existing webrtcbin (e.g., in a pipeline owned
+ * by the application), rather than having the library create a pipeline:
+ * must be called before whip_session_start(), and before the webrtcbin
+ * sink pads are linked (the application is in charge of state changes) */
+gboolean whip_session_attach(whip_session *session, GstElement *webrtcbin);
+/* Set the callbacks to be notified about events */
+void whip_session_set_callbacks(whip_session *session, const whip_callbacks *callbacks, gpointer user_data);
+/* Start the session (create/configure the pipeline, and publish) */
+gboolean whip_session_start(whip_session *session);
+/* Publish a session started in standby mode: if the offer and candidates
+ * are not ready yet, the offer is sent as soon as they are */
+gboolean whip_session_publish(whip_session *session);
+/* Stop the session (sends a DELETE to the WHIP resource, if any): this
+ * blocks until the DELETE completes, or the teardown timeout expires */
+void whip_session_stop(whip_session *session, const char *reason);
+/* Stop the session without blocking: an EOS is sent first (if the library
+ * owns the pipeline), so that encoders flush their final frames, and then
+ * the DELETE is sent asynchronously; the disconnected callback is invoked
+ * when the DELETE completes, or when the teardown timeout expires */
+void whip_session_shutdown(whip_session *session, const char *reason);
+/* Get the current state of the session */
+whip_session_state whip_session_get_state(whip_session *session);
+/* Get the pipeline the session is publishing (don't unref it) */
+GstElement *whip_session_get_pipeline(whip_session *session);
+/* Get the stats of the session as a JSON string (to be freed with g_free) */
+char *whip_session_get_stats(whip_session *session);
+/* Destroy a session (the pipeline, if owned, is stopped as well) */
+void whip_session_free(whip_session *session);
+
+#endif